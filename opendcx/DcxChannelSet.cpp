@@ -354,12 +354,6 @@ getLayerPositionFromKind (ChannelIdx kind)
 //
 //-----------------------------------------------------------------------------
 
-//
-// Iterator to this always returns 0 (Chan_Invalid):
-//
-/*static*/ ChannelIdxSet ChannelSet::m_npos;
-
-
 /*friend*/
 std::ostream&
 operator << (std::ostream& os,
@@ -381,17 +375,14 @@ void ChannelSet::print (const char* prefix,
     if (prefix && prefix[0])
         os << prefix;
     os << "[";
-    if (m_mask.size() == 0)
+    if (this->empty())
         os << "none";
-    else if (m_mask.size() == 1)
-        if (ctx)
-            ctx->printChannelFullName(os, *m_mask.begin());
-        else
-            os << *m_mask.begin();
+    else if (this->all())
+        os << "all";
     else
     {
         int i = 0;
-        for (ChannelIdxSet::const_iterator z=m_mask.begin(); z != m_mask.end(); ++z)
+        foreach_channel(z, (*this))
         {
             if (i++ > 0)
                 os << ",";
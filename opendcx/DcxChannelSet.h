@@ -91,12 +91,19 @@ class ChannelContext;
 //---------------------------------------------------------------------------
 //
 //  class ChannelSet
-//      A std::set wrapper class that acts similar to DD::Image::ChannelSet.
+//      A fixed-size bitset class that acts similar to DD::Image::ChannelSet.
 //
 //      The set contains ChannelIdx indices.  Use the foreach_channel()
 //      macro to iterate through the set (similar to Nuke's
 //      DD::Image foreach() macro.)
 //
+//      Storage is a fixed array of 64-bit words covering ChannelIdx 0..Chan_Max,
+//      so copying a set never touches the heap and union/intersection/contains
+//      tests are word-wise operations.  ChannelIdx values above Chan_Max are
+//      ignored, except for the Chan_All marker which is stored in the
+//      (otherwise unused) Chan_Invalid bit and is never visited by the
+//      iterators.
+//
 //---------------------------------------------------------------------------
 
 class DCX_EXPORT ChannelSet
@@ -112,7 +119,7 @@ class DCX_EXPORT ChannelSet
         friend class ChannelSet;
       public:
         iterator ();
-        iterator (const ChannelIdxSet::iterator&);
+        explicit iterator (ChannelIdx);
 
         ChannelIdx  channel () const;
         ChannelIdx  operator *  ();
@@ -126,7 +133,7 @@ class DCX_EXPORT ChannelSet
                                           const iterator&);
 
       protected:
-        ChannelIdxSet::iterator m_it;
+        ChannelIdx  m_channel;      // Current channel, Chan_Invalid when past the end
     };
 
     typedef iterator const_iterator;
@@ -197,10 +204,10 @@ class DCX_EXPORT ChannelSet
     bool    all () const;
 
 
-    //--------------------------------------------------------------
-    // Read/write access to the wrapped std::set - use with caution!
-    //--------------------------------------------------------------
-    ChannelIdxSet&  mask ();
+    //---------------------------------------------
+    // Returns a copy of the set as a ChannelIdxSet
+    //---------------------------------------------
+    ChannelIdxSet   mask () const;
 
 
     //----------------------------
@@ -265,6 +272,13 @@ class DCX_EXPORT ChannelSet
     void    operator &= (ChannelIdx);
 
 
+    //----------------------------------------
+    // Equality - true if the bits all match
+    //----------------------------------------
+    bool    operator == (const ChannelSet&) const;
+    bool    operator != (const ChannelSet&) const;
+
+
     //--------------------------------------------------------------------
     // Print info about the set to an output stream.
     // If the ChannelContext is NULL only the ChannelIdx number will be
@@ -281,11 +295,28 @@ class DCX_EXPORT ChannelSet
     friend std::ostream& operator << (std::ostream&,
                                       const ChannelSet&);
 
+
+    //------------------------------------------------------
+    // Bit utilities on 64-bit words, shared with other
+    // bitmask classes.  Results are undefined for a zero
+    // word in lowestBit() and highestBit().
+    //------------------------------------------------------
+
+    static int  lowestBit (uint64_t);
+    static int  highestBit (uint64_t);
+    static int  bitCount (uint64_t);
+
+
   protected:
 
-    ChannelIdxSet   m_mask;         // Unique set of ChannelIdx's
+    enum { numWords = (Chan_Max + 64) / 64 };
+
+    uint64_t    m_bits[numWords];   // One bit per ChannelIdx, bit 0 is the Chan_All marker
 
-    static ChannelIdxSet m_npos;    // An iterator to this always returns 0 (Chan_Invalid)
+    // Find the first/last set bit at or above/below a channel, ignoring the
+    // Chan_All marker.  Returns Chan_Invalid if there's none.
+    ChannelIdx  findNext (ChannelIdx from) const;
+    ChannelIdx  findPrev (ChannelIdx from) const;
 };
 
 
@@ -330,117 +361,255 @@ ChannelSet operator & (const ChannelSet&,
 // Inline Functions
 //-----------------
 
-inline ChannelSet::ChannelSet () {}
-inline ChannelSet::iterator::iterator () : m_it() {}
-inline ChannelSet::iterator::iterator (const ChannelIdxSet::iterator& it) : m_it(it) {}
-inline ChannelIdx ChannelSet::iterator::channel () const { return *m_it; }
-inline ChannelIdx ChannelSet::iterator::operator * () { return this->channel(); }
-inline bool ChannelSet::iterator::operator != (const iterator& b) const { return (m_it != b.m_it); }
-inline bool ChannelSet::iterator::operator != (ChannelIdx channel) const { return (*m_it != channel); }
-inline bool ChannelSet::iterator::operator == (const iterator& b) const { return (m_it == b.m_it); }
-inline bool ChannelSet::iterator::operator == (ChannelIdx channel) const { return (*m_it == channel); }
+inline ChannelSet::iterator::iterator () : m_channel(Chan_Invalid) {}
+inline ChannelSet::iterator::iterator (ChannelIdx channel) : m_channel(channel) {}
+inline ChannelIdx ChannelSet::iterator::channel () const { return m_channel; }
+inline ChannelIdx ChannelSet::iterator::operator * () { return m_channel; }
+inline bool ChannelSet::iterator::operator != (const iterator& b) const { return (m_channel != b.m_channel); }
+inline bool ChannelSet::iterator::operator != (ChannelIdx channel) const { return (m_channel != channel); }
+inline bool ChannelSet::iterator::operator == (const iterator& b) const { return (m_channel == b.m_channel); }
+inline bool ChannelSet::iterator::operator == (ChannelIdx channel) const { return (m_channel == channel); }
+//--------------------------------------------------------
+/*static*/ inline int ChannelSet::lowestBit (uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    if ((v & 0xffffffffull) == 0) { n += 32; v >>= 32; }
+    if ((v & 0xffffull) == 0) { n += 16; v >>= 16; }
+    if ((v & 0xffull) == 0) { n += 8; v >>= 8; }
+    if ((v & 0xfull) == 0) { n += 4; v >>= 4; }
+    if ((v & 0x3ull) == 0) { n += 2; v >>= 2; }
+    if ((v & 0x1ull) == 0) { n += 1; }
+    return n;
+#endif
+}
+/*static*/ inline int ChannelSet::highestBit (uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(v);
+#else
+    int n = 0;
+    if (v >> 32) { n += 32; v >>= 32; }
+    if (v >> 16) { n += 16; v >>= 16; }
+    if (v >> 8) { n += 8; v >>= 8; }
+    if (v >> 4) { n += 4; v >>= 4; }
+    if (v >> 2) { n += 2; v >>= 2; }
+    if (v >> 1) { n += 1; }
+    return n;
+#endif
+}
+/*static*/ inline int ChannelSet::bitCount (uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ull);
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return int((v * 0x0101010101010101ull) >> 56);
+#endif
+}
+//--------------------------------------------------------
+inline ChannelIdx ChannelSet::findNext (ChannelIdx from) const
+{
+    if (from < 1)
+        from = 1; // skip the Chan_All marker
+    if (from > Chan_Max)
+        return Chan_Invalid;
+    size_t w = from >> 6;
+    uint64_t bits = m_bits[w] & (~0ull << (from & 63));
+    while (1)
+    {
+        if (bits)
+            return ChannelIdx((w << 6) + lowestBit(bits));
+        if (++w >= numWords)
+            return Chan_Invalid;
+        bits = m_bits[w];
+    }
+}
+inline ChannelIdx ChannelSet::findPrev (ChannelIdx from) const
+{
+    if (from < 1)
+        return Chan_Invalid;
+    if (from > Chan_Max)
+        from = Chan_Max;
+    size_t w = from >> 6;
+    uint64_t bits = m_bits[w] & (~0ull >> (63 - (from & 63)));
+    if (w == 0)
+        bits &= ~1ull; // skip the Chan_All marker
+    while (1)
+    {
+        if (bits)
+            return ChannelIdx((w << 6) + highestBit(bits));
+        if (w-- == 0)
+            return Chan_Invalid;
+        bits = (w == 0)?(m_bits[0] & ~1ull):m_bits[w];
+    }
+}
 //--------------------------------------------------------
-inline void ChannelSet::insert (ChannelIdx channel) { if (channel > Chan_Invalid) m_mask.insert(channel); }
-inline ChannelSet::ChannelSet (const ChannelSet& b) : m_mask(b.m_mask) {}
-inline ChannelSet::ChannelSet (const ChannelIdxSet& mask) : m_mask(mask) {}
+inline void ChannelSet::clear () { for (size_t i=0; i < numWords; ++i) m_bits[i] = 0ull; }
+inline void ChannelSet::insert (ChannelIdx channel)
+{
+    if (channel == Chan_All)
+        m_bits[0] |= 1ull;
+    else if (channel > Chan_Invalid && channel <= Chan_Max)
+        m_bits[channel >> 6] |= (1ull << (channel & 63));
+}
+inline ChannelSet::ChannelSet () { this->clear(); }
+inline ChannelSet::ChannelSet (const ChannelSet& b)
+{
+    for (size_t i=0; i < numWords; ++i)
+        m_bits[i] = b.m_bits[i];
+}
+inline ChannelSet::ChannelSet (const ChannelIdxSet& b) { this->clear(); this->insert(b); }
 inline ChannelSet::ChannelSet (ChannelIdx a, ChannelIdx b, ChannelIdx c, ChannelIdx d, ChannelIdx e)
 {
+    this->clear();
     this->insert(a); this->insert(b); this->insert(c); this->insert(d); this->insert(e);
 }
 //
-inline ChannelSet& ChannelSet::operator = (const ChannelSet& b) { m_mask = b.m_mask; return *this; }
-inline ChannelSet& ChannelSet::operator = (ChannelIdx channel) { m_mask.clear(); this->insert(channel); return *this; }
-//
-inline void   ChannelSet::clear () { m_mask.clear(); }
-inline size_t ChannelSet::size () const { return m_mask.size(); }
-inline bool   ChannelSet::empty () const { return (m_mask.size() == 0); }
-inline bool   ChannelSet::all () const { return (m_mask.size() == 1 && *m_mask.begin() == Chan_All); }
-inline ChannelIdxSet& ChannelSet::mask () { return m_mask; }
+inline ChannelSet& ChannelSet::operator = (const ChannelSet& b)
+{
+    for (size_t i=0; i < numWords; ++i)
+        m_bits[i] = b.m_bits[i];
+    return *this;
+}
+inline ChannelSet& ChannelSet::operator = (ChannelIdx channel) { this->clear(); this->insert(channel); return *this; }
 //
-inline ChannelSet::iterator ChannelSet::first () const
+inline size_t ChannelSet::size () const
+{
+    size_t n = 0;
+    for (size_t i=0; i < numWords; ++i)
+        n += bitCount(m_bits[i]);
+    return n;
+}
+inline bool   ChannelSet::empty () const
+{
+    for (size_t i=0; i < numWords; ++i)
+        if (m_bits[i])
+            return false;
+    return true;
+}
+inline bool   ChannelSet::all () const
+{
+    if (m_bits[0] != 1ull)
+        return false;
+    for (size_t i=1; i < numWords; ++i)
+        if (m_bits[i])
+            return false;
+    return true;
+}
+inline ChannelIdxSet ChannelSet::mask () const
 {
-    if (m_mask.size() == 0)
-        return ChannelSet::iterator(m_npos.end());
-    return ChannelSet::iterator(m_mask.begin());
+    ChannelIdxSet s;
+    if (m_bits[0] & 1ull)
+        s.insert(Chan_All);
+    for (ChannelIdx z=findNext(1); z != Chan_Invalid; z=findNext(z+1))
+        s.insert(s.end(), z);
+    return s;
 }
+//
+inline ChannelSet::iterator ChannelSet::first () const { return ChannelSet::iterator(findNext(1)); }
+inline ChannelSet::iterator ChannelSet::last () const { return ChannelSet::iterator(findPrev(Chan_Max)); }
 inline ChannelSet::iterator ChannelSet::prev (iterator it) const
 {
-    if (it.m_it == m_mask.begin())
-        return ChannelSet::iterator(m_mask.begin());
-    else if (it.m_it == m_npos.end())
+    if (it.m_channel == Chan_Invalid)
         return it;
-    return ChannelSet::iterator(--it.m_it);
+    const ChannelIdx z = findPrev(it.m_channel - 1);
+    return (z == Chan_Invalid)?this->first():ChannelSet::iterator(z);
 }
 inline ChannelSet::iterator ChannelSet::next (iterator it) const
 {
-    if (it.m_it == m_npos.end() || it.m_it == m_mask.end())
-        return ChannelSet::iterator(m_npos.end());
-    if (++it.m_it == m_mask.end())
-        return ChannelSet::iterator(m_npos.end());
-    return ChannelSet::iterator(it.m_it);
+    if (it.m_channel == Chan_Invalid)
+        return it;
+    return ChannelSet::iterator(findNext(it.m_channel + 1));
 }
-inline ChannelSet::iterator ChannelSet::last () const
+//
+inline bool   ChannelSet::contains (ChannelIdx channel) const
 {
-    if (m_mask.size() == 0)
-        return ChannelSet::iterator(m_npos.end());
-    return this->prev(ChannelSet::iterator(m_mask.end()));
+    if (channel == Chan_All)
+        return (m_bits[0] & 1ull) != 0;
+    if (channel == Chan_Invalid || channel > Chan_Max)
+        return false;
+    return (m_bits[channel >> 6] & (1ull << (channel & 63))) != 0;
 }
-//
-inline bool   ChannelSet::contains (ChannelIdx channel) const { return (m_mask.find(channel) != m_mask.end()); }
 inline bool   ChannelSet::contains (const ChannelIdxSet& b) const {
     for (ChannelIdxSet::const_iterator z=b.begin(); z != b.end(); ++z)
-        if (m_mask.find(*z) == m_mask.end())
+        if (!this->contains(*z))
+            return false;
+    return true;
+}
+inline bool   ChannelSet::contains (const ChannelSet& b) const
+{
+    for (size_t i=0; i < numWords; ++i)
+        if ((m_bits[i] & b.m_bits[i]) != b.m_bits[i])
             return false;
     return true;
 }
-inline bool   ChannelSet::contains (const ChannelSet& b) const { return this->contains(b.m_mask); }
 //
 inline void   ChannelSet::insert (const ChannelIdxSet& b)
 {
     for (ChannelIdxSet::const_iterator z=b.begin(); z != b.end(); ++z)
         this->insert(*z);
 }
-inline void   ChannelSet::insert (const ChannelSet& b) { this->insert(b.m_mask); }
-inline void   ChannelSet::operator += (const ChannelSet& b) { this->insert(b.m_mask); }
+inline void   ChannelSet::insert (const ChannelSet& b)
+{
+    for (size_t i=0; i < numWords; ++i)
+        m_bits[i] |= b.m_bits[i];
+}
+inline void   ChannelSet::operator += (const ChannelSet& b) { this->insert(b); }
 inline void   ChannelSet::operator += (const ChannelIdxSet& b) { this->insert(b); }
 inline void   ChannelSet::operator += (ChannelIdx channel) { this->insert(channel); }
 //
+inline void   ChannelSet::erase (ChannelIdx channel)
+{
+    if (channel == Chan_All)
+        m_bits[0] &= ~1ull;
+    else if (channel > Chan_Invalid && channel <= Chan_Max)
+        m_bits[channel >> 6] &= ~(1ull << (channel & 63));
+}
 inline void   ChannelSet::erase (const ChannelIdxSet& b)
 {
     for (ChannelIdxSet::const_iterator z=b.begin(); z != b.end(); ++z)
-        m_mask.erase(*z);
+        this->erase(*z);
+}
+inline void   ChannelSet::erase (const ChannelSet& b)
+{
+    for (size_t i=0; i < numWords; ++i)
+        m_bits[i] &= ~b.m_bits[i];
 }
-inline void   ChannelSet::erase (const ChannelSet& b) { this->erase(b.m_mask); }
-inline void   ChannelSet::erase (ChannelIdx channel) { m_mask.erase(channel); }
-inline void   ChannelSet::operator -= (ChannelIdx channel) { m_mask.erase(channel); }
+inline void   ChannelSet::operator -= (ChannelIdx channel) { this->erase(channel); }
 inline void   ChannelSet::operator -= (const ChannelIdxSet& b) { this->erase(b); }
-inline void   ChannelSet::operator -= (const ChannelSet& b) { this->erase(b.m_mask); }
+inline void   ChannelSet::operator -= (const ChannelSet& b) { this->erase(b); }
 //
-inline void   ChannelSet::intersect (const ChannelIdxSet& b)
+inline void   ChannelSet::intersect (const ChannelIdxSet& b) { this->intersect(ChannelSet(b)); }
+inline void   ChannelSet::intersect (const ChannelSet& b)
 {
-    std::vector<ChannelIdx> erase_list;
-    erase_list.reserve(m_mask.size());
-    for (ChannelIdxSet::const_iterator z=m_mask.begin(); z != m_mask.end(); ++z)
-        if (b.find(*z) == b.end())
-            erase_list.push_back(*z);
-    for (size_t i=0; i < erase_list.size(); ++i)
-        m_mask.erase(erase_list[i]);
+    for (size_t i=0; i < numWords; ++i)
+        m_bits[i] &= b.m_bits[i];
 }
-inline void   ChannelSet::intersect (const ChannelSet& b) { this->intersect(b.m_mask); }
 inline void   ChannelSet::intersect (ChannelIdx chan)
 {
-    if (m_mask.find(chan) != m_mask.end())
-    {
-        m_mask.clear();
-        m_mask.insert(chan);
-    }
-    else
-        m_mask.clear();
+    const bool had_chan = this->contains(chan);
+    this->clear();
+    if (had_chan)
+        this->insert(chan);
 }
-inline void   ChannelSet::operator &= (const ChannelSet& b) { this->intersect(b.m_mask); }
+inline void   ChannelSet::operator &= (const ChannelSet& b) { this->intersect(b); }
 inline void   ChannelSet::operator &= (const ChannelIdxSet& b) { this->intersect(b); }
 inline void   ChannelSet::operator &= (ChannelIdx channel) { this->intersect(channel); }
 //
+inline bool   ChannelSet::operator == (const ChannelSet& b) const
+{
+    for (size_t i=0; i < numWords; ++i)
+        if (m_bits[i] != b.m_bits[i])
+            return false;
+    return true;
+}
+inline bool   ChannelSet::operator != (const ChannelSet& b) const { return !(*this == b); }
+//
 inline ChannelSet ChannelSet::operator | (const ChannelSet& b) { this->insert(b); return *this; }
 inline ChannelSet ChannelSet::operator & (const ChannelSet& b) { this->intersect(b); return *this; }
 //--------------------------------------------------------
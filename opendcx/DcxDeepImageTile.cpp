@@ -41,10 +41,86 @@
 
 #include <OpenEXR/ImfHeader.h>
 #include <OpenEXR/ImfDeepImage.h>
+#include <OpenEXR/ImfThreading.h>
+
+#include <string.h> // for strcmp
+
+#ifdef __F16C__
+#  include <immintrin.h>
+#endif
 
 OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
 
 
+//
+// Convert a run of halfs to floats, eight at a time with F16C if the
+// compiler's targeting it (ex. -mf16c or -march=native.)
+//
+
+static inline void
+halfsToFloats (const half* in,
+               size_t n,
+               float* out)
+{
+    size_t i = 0;
+#ifdef __F16C__
+    for (; i+8 <= n; i += 8)
+        _mm256_storeu_ps(out+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in+i))));
+#endif
+    for (; i < n; ++i)
+        out[i] = float(in[i]);
+}
+
+
+DeepImageInputTile::ChannelReader::ChannelReader (Dcx::ChannelIdx _channel,
+                                                  const Imf::DeepImageChannel* _ptr) :
+    channel(_channel),
+    ptr(_ptr),
+    type(_ptr->pixelType())
+{
+    //
+}
+
+
+void
+DeepImageInputTile::ChannelReader::read (int x,
+                                         int y,
+                                         size_t nSamples,
+                                         float* values) const
+{
+    switch (type)
+    {
+        case Imf::HALF:
+            halfsToFloats((*static_cast<const Imf::TypedDeepImageChannel<half>* >(ptr))(x, y), nSamples, values);
+            break;
+        case Imf::FLOAT:
+        {
+            const float* IN = (*static_cast<const Imf::TypedDeepImageChannel<float>* >(ptr))(x, y);
+            for (size_t i=0; i < nSamples; ++i)
+                values[i] = IN[i];
+            break;
+        }
+        case Imf::UINT:
+        {
+            const unsigned int* IN = (*static_cast<const Imf::TypedDeepImageChannel<unsigned int>* >(ptr))(x, y);
+            for (size_t i=0; i < nSamples; ++i)
+                values[i] = float(IN[i]);
+            break;
+        }
+        default:
+#ifdef DEBUG
+            assert(false);
+#endif
+            for (size_t i=0; i < nSamples; ++i)
+                values[i] = 0.0f;
+            break;
+    }
+}
+
+
+//-------------------------------------------------------------------------
+
+
 DeepImageInputTile::DeepImageInputTile (ChannelContext& channel_ctx,
                                         bool tileYup) :
     DeepTile(channel_ctx, WRITE_DISABLED, tileYup),
@@ -56,9 +132,11 @@ DeepImageInputTile::DeepImageInputTile (ChannelContext& channel_ctx,
 
 DeepImageInputTile::DeepImageInputTile (const Imf::DeepImage& image,
                                         ChannelContext& channel_ctx,
-                                        bool tileYup) :
+                                        bool tileYup,
+                                        const ChannelSet& read_channels) :
     DeepTile(channel_ctx, WRITE_DISABLED, tileYup),
-    m_image_level(NULL)
+    m_image_level(NULL),
+    m_read_channels(read_channels)
 {
     if (image.numLevels() > 0)
     {
@@ -75,9 +153,11 @@ DeepImageInputTile::DeepImageInputTile (const Imf::DeepImage& image,
 DeepImageInputTile::DeepImageInputTile (const Imf::Header& header,
                                         const Imf::DeepImage& image,
                                         ChannelContext& channel_ctx,
-                                        bool tileYup) :
+                                        bool tileYup,
+                                        const ChannelSet& read_channels) :
     DeepTile(channel_ctx, WRITE_DISABLED, tileYup),
-    m_image_level(NULL)
+    m_image_level(NULL),
+    m_read_channels(read_channels)
 {
     if (image.numLevels() > 0)
     {
@@ -125,70 +205,53 @@ DeepImageInputTile::updateChannelPtrs ()
     if (!m_image_level)
         return false;
 
-    // Copy the channel data ptrs out of the DeepImageLevel:
-    m_chan_ptrs.clear();
-    std::vector<Dcx::ChannelIdx> chans;
+    // Copy the channel names and data ptrs out of the DeepImageLevel:
+    std::vector<std::string> names;
     std::vector<const Imf::DeepImageChannel*> ptrs;
-    Dcx::ChannelAliasPtrSet tile_channels; // set of channels to initialize tile to
-
-#ifdef DEBUG
-    assert(m_channel_ctx);
-#endif
-
     for (Imf::DeepImageLevel::ConstIterator it=m_image_level->begin(); it != m_image_level->end(); ++it)
     {
-#if 1
-        ChannelAlias* c = m_channel_ctx->getChannelAlias(it.name());
-        if (!c || c->channel() == Dcx::Chan_Invalid)
-            continue; // error creating the alias!  TODO: throw exception?
-
-        chans.push_back(c->channel());
+        names.push_back(it.name());
         ptrs.push_back(&it.channel());
+    }
 
-        tile_channels.insert(c);
-
-#else
-        Dcx::ChannelIdx z = Dcx::getChannel(it.name().c_str());
-
-        if (z == Dcx::Chan_DeepFlags && m_flags_channel == Dcx::Chan_Invalid)
-        {
-            m_flags_channel = z;
-            chans.push_back(z);
-            ptrs.push_back(&it.channel());
-        }
-        else if (z >= Chan_SpBits1 && z <= Chan_SpBits2 &&
-                 !spmask_channels.contains(z))
-        {
-            ++m_num_spmask_chans;
-            spmask_channels += z;
-            chans.push_back(z);
-            ptrs.push_back(&it.channel());
-        }
-        else if (z != Dcx::Chan_Invalid)
-        {
-            // Translate channel "Z" into Chan_ZFront:
-            if (z == Dcx::Chan_Z)
-                z = Dcx::Chan_ZFront;
-
-            m_channels += z;
-            chans.push_back(z);
-            ptrs.push_back(&it.channel());
-        }
+#ifdef DEBUG
+    assert(m_channel_ctx);
 #endif
-    }
 
     // Update the active channel set:
-    DeepTile::updateChannels(tile_channels);
+    std::vector<int> channel_map;
+    mapFileChannels(names, m_read_channels, channel_map);
 
-    m_chan_ptrs.resize(m_channel_ctx->lastAssignedChannel());
-    memset(&(m_chan_ptrs[0]), 0, sizeof(Imf::DeepImageChannel*)*m_chan_ptrs.size()); // << TODO: is this needed?
-    for (size_t i=0; i < chans.size(); ++i)
-        m_chan_ptrs[chans[i]] = ptrs[i];
+    m_chan_ptrs.clear();
+    m_chan_ptrs.resize(channel_map.size(), (const Imf::DeepImageChannel*)NULL);
+    for (size_t z=0; z < channel_map.size(); ++z)
+        if (channel_map[z] >= 0)
+            m_chan_ptrs[z] = ptrs[channel_map[z]];
+
+    // Resolve the pixel type of each channel the tile accepted:
+    m_readers.clear();
+    m_reader_index.clear();
+    m_reader_index.resize(m_chan_ptrs.size(), -1);
+    foreach_channel(z, m_channels)
+    {
+        if (*z >= m_chan_ptrs.size() || !m_chan_ptrs[*z])
+            continue;
+        m_reader_index[*z] = (int)m_readers.size();
+        m_readers.push_back(ChannelReader(*z, m_chan_ptrs[*z]));
+    }
 
     return true;
 }
 
 
+void
+DeepImageInputTile::setReadChannels (const ChannelSet& read_channels)
+{
+    m_read_channels = read_channels;
+    updateChannelPtrs();
+}
+
+
 /*virtual*/
 size_t
 DeepImageInputTile::getNumSamplesAt (int x, int y) const
@@ -214,50 +277,30 @@ DeepImageInputTile::getDeepPixel (int x,
     if (m_channels.empty())
         return true;
 
-    const size_t nSamples = m_image_level->sampleCounts()(x, (m_tile_yUp)?(m_display_window.max.y-y):y);
+    const int file_y = (m_tile_yUp)?(m_display_window.max.y-y):y;
+    const size_t nSamples = m_image_level->sampleCounts()(x, file_y);
     if (nSamples == 0)
         return true;
 
-    // Copy sample data out of channel ptrs:
-    pixel.reserve(nSamples);
-
-    Dcx::ChannelSet copy_channels(m_channels);
-    copy_channels -= Dcx::Mask_Deep;
-    copy_channels -= Dcx::Mask_DeepMetadata;
-    copy_channels -= Dcx::Mask_Z;
-    pixel.setChannels(copy_channels);
-
-    const bool have_Zb  = (m_channels.contains(Dcx::Chan_ZBack));
-
-    Dcx::DeepSegment ds;
-    for (size_t sample=0; sample < nSamples; ++sample)
+    // Convert each mapped channel's samples to float in one pass.  Typical
+    // pixels fit in the stack buffers:
+    const size_t nReaders = m_readers.size();
+    ScratchArray<float, 2048> values_scratch;
+    float* values = values_scratch.get(nReaders*nSamples);
+    for (size_t i=0; i < nReaders; ++i)
+        m_readers[i].read(x, file_y, nSamples, values + i*nSamples);
+
+    ScratchArray<const float*, 64> channel_scratch;
+    const float** channel_values = channel_scratch.get(m_channels.size());
+    size_t c = 0;
+    foreach_channel(z, m_channels)
     {
-        ds.Zf = ds.Zb = getChannelSampleValueAt(x, y, sample, m_chan_ptrs[Dcx::Chan_ZFront]);
-        // Skip samples with negative, infinite or nan Zfront:
-        if (ds.Zf < 0.0f || isinf(ds.Zf) || isnan(ds.Zf))
-            continue;
-
-        if (have_Zb)
-        {
-            ds.Zb = getChannelSampleValueAt(x, y, sample, m_chan_ptrs[Dcx::Chan_ZBack]);
-            // Clamp Zback to reasonable values - allow infinity:
-            if (isnan(ds.Zb) || ds.Zb < ds.Zf)
-                ds.Zb = ds.Zf;
-        }
-
-        ds.index = (int)sample;
-
-        // Extract metadata from input channels:
-        if (!getSampleMetadata(x, y, sample, ds.metadata))
-            return false;
-
-        // Add segment and copy pixel data:
-        const size_t dsindex = pixel.append(ds);
-        Dcx::Pixelf& p = pixel.getSegmentPixel(dsindex);
-        foreach_channel(z, copy_channels)
-            p[*z] = getChannelSampleValueAt(x, y, sample, m_chan_ptrs[*z]);
+        const int i = (*z < m_reader_index.size())?m_reader_index[*z]:-1;
+        channel_values[c++] = (i < 0)?NULL:(values + size_t(i)*nSamples);
     }
 
+    packedSamplesToDeepPixel(channel_values, nSamples, pixel);
+
     return true;
 }
 
@@ -269,27 +312,24 @@ DeepImageInputTile::getSampleMetadata (int x,
                                        size_t sample,
                                        Dcx::DeepMetadata& metadata) const
 {
-    if (m_num_spmask_chans == 2)
-    {
-        metadata.spmask.fromFloat(getChannelSampleValueAt(x, y, sample, m_chan_ptrs[Dcx::Chan_SpBits1]),
-                                  getChannelSampleValueAt(x, y, sample, m_chan_ptrs[Dcx::Chan_SpBits2]));
-
-    }
-    else if (m_num_spmask_chans == 1)
-    {
-        //metadata.spmask = Dcx::spMask4From1Float(getChannelSampleValueAt(x, y, sample, m_chan_ptrs[Dcx::Chan_SpBits1]));
-
-    }
-    else
+    // Only the deep metadata channels are needed, leave the rest NULL:
+    ScratchArray<float, 64> values_scratch;
+    float* values = values_scratch.get(m_channels.size());
+    ScratchArray<const float*, 64> channel_scratch;
+    const float** channel_values = channel_scratch.get(m_channels.size());
+    size_t c = 0;
+    foreach_channel(z, m_channels)
     {
-        metadata.spmask = Dcx::SpMask8::zeroCoverage; // default to zero coverage (legacy data)
+        channel_values[c] = NULL;
+        if ((*z == Dcx::Chan_SpBits1 || *z == Dcx::Chan_SpBits2 || *z == m_flags_channel) &&
+            *z < m_chan_ptrs.size() && m_chan_ptrs[*z])
+        {
+            values[c] = getChannelSampleValueAt(x, y, sample, m_chan_ptrs[*z]);
+            channel_values[c] = &values[c];
+        }
+        ++c;
     }
-
-    // Extract flags from flags channel (convert from floating-point integer value):
-    if (m_flags_channel != Dcx::Chan_Invalid)
-        metadata.flags = (Dcx::DeepFlag)floorf(getChannelSampleValueAt(x, y, sample, m_chan_ptrs[m_flags_channel]));
-    else
-        metadata.flags = Dcx::DEEP_EMPTY_FLAG;
+    packedSampleMetadata(channel_values, 0, metadata);
 
     return true;
 }
@@ -304,9 +344,11 @@ DeepImageOutputTile::DeepImageOutputTile (const IMATH_NAMESPACE::Box2i& display_
                                           bool sourceWindowsYup,
                                           const ChannelAliasPtrSet& channels,
                                           ChannelContext& channel_ctx,
-                                          bool tileYup) :
-    DeepTile (display_window, data_window, sourceWindowsYup, channels, channel_ctx, WRITE_RANDOM, tileYup),
-    m_file(0)
+                                          bool tileYup,
+                                          WriteAccessMode write_access_mode) :
+    DeepTile (display_window, data_window, sourceWindowsYup, channels, channel_ctx, write_access_mode, tileYup),
+    m_file(0),
+    m_write_batch_lines(0)
 {
 #if 0
     // Make sure output channels have Z's, metadata enabled:
@@ -324,16 +366,21 @@ DeepImageOutputTile::DeepImageOutputTile (const IMATH_NAMESPACE::Box2i& display_
 }
 
 
-DeepImageOutputTile::DeepImageOutputTile (const DeepTile& b) :
+DeepImageOutputTile::DeepImageOutputTile (const DeepTile& b,
+                                          WriteAccessMode write_access_mode) :
     DeepTile(b),
-    m_file(0)
+    m_file(0),
+    m_write_batch_lines(0)
 {
+    m_write_access_mode = write_access_mode;
     resizeDataWindow(m_data_window);
 }
 
 
 DeepImageOutputTile::~DeepImageOutputTile ()
 {
+    // Write any buffered lines, but don't throw from a destructor:
+    try { flush(); } catch (...) {}
     const size_t nLines = m_deep_lines.size();
     for (size_t y=0; y < nLines; ++y)
         delete m_deep_lines[y];
@@ -369,6 +416,8 @@ DeepImageOutputTile::deleteDeepLines ()
         delete m_deep_lines[j];
         m_deep_lines[j] = 0;
     }
+    m_pending_lines.clear();
+    m_pending_flush.clear();
 }
 
 
@@ -398,12 +447,42 @@ DeepImageOutputTile::getNumSamplesAt (int x, int y) const
 //----------------------------------------------------------
 
 
+//
+// Returns the value packed into channel z's array for a segment.
+//
+
+static inline float
+segmentValue (Dcx::ChannelIdx z,
+              const DeepSegment& segment,
+              const Pixelf& pixel,
+              float sp1,
+              float sp2,
+              const ChannelSet& pixel_channels)
+{
+    if (z == Dcx::Chan_ZFront)
+        return segment.Zf;
+    else if (z == Dcx::Chan_ZBack)
+        return segment.Zb;
+    else if (z == Dcx::Chan_SpBits1)
+        return sp1;
+    else if (z == Dcx::Chan_SpBits2)
+        return sp2;
+    else if (z == Dcx::Chan_DeepFlags)
+        return float(segment.flags());
+    else if (pixel_channels.contains(z))
+        return pixel[z];
+    return 0.0f;
+}
+
+
 DeepImageOutputTile::DeepLine::DeepLine (uint32_t width,
                                          const ChannelSet& _channels) :
-    channels(_channels)
+    channels(_channels),
+    append_start(0)
 {
     channel_arrays.resize(channels.size());
     samples_per_pixel.resize(width, 0);
+    pixel_offsets.resize(width, 0);
 }
 
 
@@ -513,6 +592,12 @@ DeepImageOutputTile::DeepLine::set (int xoffset,
         clear(xoffset);
         return;
     }
+    if ((uint32_t)xoffset >= append_start)
+    {
+        // Nothing's been written at or after xoffset so there's nothing to shift:
+        append(xoffset, deep_pixel);
+        return;
+    }
 
     const uint32_t foffset = floatOffset(xoffset);
     const uint32_t nCurrSegments = samples_per_pixel[xoffset];
@@ -528,9 +613,9 @@ DeepImageOutputTile::DeepLine::set (int xoffset,
 #ifdef DEBUG
             assert(foffset <= values.size()); // shouldn't happen...
 #endif
-            // Round the memory reserve up in chunks to avoid constantly resizing/copying:
+            // Grow the memory reserve by half again to avoid constantly resizing/copying:
             if (values.capacity() < values.size()+nAdd)
-                values.reserve(values.size() + (size_t)int(float(values.size())/1.5f));
+                values.reserve(std::max(values.size()+nAdd, values.size() + values.size()/2));
             values.insert(values.begin() + foffset, nAdd, 0.0f);
         }
     }
@@ -548,6 +633,7 @@ DeepImageOutputTile::DeepLine::set (int xoffset,
     }
 
     samples_per_pixel[xoffset] = nWriteSegments;
+    shiftOffsets(xoffset, int32_t(nWriteSegments) - int32_t(nCurrSegments));
 
     if (nWriteSegments > 0)
     {
@@ -559,30 +645,47 @@ DeepImageOutputTile::DeepLine::set (int xoffset,
             const Pixelf& pixel = deep_pixel.getSegmentPixel(segment);
             segment.spMask().toFloat(sp1, sp2);
 
-            float v;
             int chan_index = 0;
             foreach_channel(z, channels)
-            {
-                if (*z == Dcx::Chan_ZFront)
-                    v = segment.Zf;
-                else if (*z == Dcx::Chan_ZBack)
-                    v = segment.Zb;
-                else if (*z == Dcx::Chan_SpBits1)
-                    v = sp1;
-                else if (*z == Dcx::Chan_SpBits2)
-                    v = sp2;
-                else if (*z == Dcx::Chan_DeepFlags)
-                    v = float(segment.flags());
-                else if (deep_pixel.channels().contains(*z))
-                    v = pixel[*z];
-                else
-                    v = 0.0f;
-                channel_arrays[chan_index++][foffset + i] = v;
-            }
+                channel_arrays[chan_index++][foffset + i] = segmentValue(*z, segment, pixel, sp1, sp2,
+                                                                         deep_pixel.channels());
         }
     }
 }
 
+
+void
+DeepImageOutputTile::DeepLine::append (int xoffset,
+                                       const Dcx::DeepPixel& deep_pixel)
+{
+#ifdef DEBUG
+    assert(xoffset >= 0 && xoffset < samples_per_pixel.size());
+    assert((uint32_t)xoffset >= append_start);
+#endif
+    // Pixels between the last one written and xoffset are empty so they
+    // all start where xoffset does, usually there's none:
+    const uint32_t foffset = floatOffset(xoffset);
+    for (uint32_t i=append_start; i <= (uint32_t)xoffset; ++i)
+        pixel_offsets[i] = foffset;
+
+    const size_t nWriteSegments = deep_pixel.size();
+    float sp1, sp2;
+    for (uint32_t i=0; i < nWriteSegments; ++i)
+    {
+        const DeepSegment& segment = deep_pixel[i];
+        const Pixelf& pixel = deep_pixel.getSegmentPixel(segment);
+        segment.spMask().toFloat(sp1, sp2);
+
+        int chan_index = 0;
+        foreach_channel(z, channels)
+            channel_arrays[chan_index++].push_back(segmentValue(*z, segment, pixel, sp1, sp2,
+                                                                deep_pixel.channels()));
+    }
+
+    samples_per_pixel[xoffset] = nWriteSegments;
+    append_start = xoffset + 1;
+}
+
 void
 DeepImageOutputTile::DeepLine::clear (int xoffset)
 {
@@ -603,6 +706,7 @@ DeepImageOutputTile::DeepLine::clear (int xoffset)
                      values.begin() + foffset + nCurrSegments);
     }
     samples_per_pixel[xoffset] = 0;
+    shiftOffsets(xoffset, -int32_t(nCurrSegments));
 }
 
 
@@ -711,14 +815,87 @@ DeepImageOutputTile::clearDeepPixel (int x,
 // channels, destroying any current file.
 //
 
+Imf::PixelType
+DeepImageOutputTile::outputPixelType (ChannelIdx z) const
+{
+    std::map<ChannelIdx, Imf::PixelType>::const_iterator it = m_output_types.find(z);
+    if (it != m_output_types.end())
+        return it->second;
+    const ChannelAlias* c = getChannelAlias(z);
+    return (c)?c->fileIOPixelType():Imf::FLOAT;
+}
+
+
+//
+// Fill in the parts of an output header shared by the scanline and tiled
+// files - compression, channels and any pass-through attributes - and
+// record the file type of each channel for the writes.
+//
+
+void
+DeepImageOutputTile::initOutputHeader (Imf::Header& header,
+                                       Imf::Compression compression,
+                                       const Imf::Header* attributes)
+{
+    switch (compression)
+    {
+        case Imf::NO_COMPRESSION:
+        case Imf::RLE_COMPRESSION:
+        case Imf::ZIPS_COMPRESSION:
+        case Imf::ZIP_COMPRESSION:
+            header.compression() = compression;
+            break;
+        default:
+            // Not supported for deep data:
+            header.compression() = Imf::ZIPS_COMPRESSION;
+            break;
+    }
+
+    m_file_types.clear();
+    foreach_channel(z, m_channels)
+    {
+        const ChannelAlias* c = getChannelAlias(*z);
+#ifdef DEBUG
+        assert(c); // shouldn't happen...
+#endif
+
+        // Use the fileIOName for EXR output channel name:
+        const Imf::PixelType type = outputPixelType(*z);
+        header.channels().insert(c->fileIOName(), Imf::Channel(type));
+        m_file_types.push_back(type);
+    }
+
+    if (attributes)
+    {
+        // Skip the attributes already set from this tile and the ones
+        // OpenEXR manages itself:
+        static const char* reserved[] = { "tiles", "type", "name", "version",
+                                          "chunkCount", "maxSamplesPerPixel", 0 };
+        for (Imf::Header::ConstIterator it=attributes->begin(); it != attributes->end(); ++it)
+        {
+            if (header.find(it.name()) != header.end())
+                continue;
+            bool skip = false;
+            for (int i=0; reserved[i]; ++i)
+                if (strcmp(it.name(), reserved[i]) == 0) { skip = true; break; }
+            if (!skip)
+                header.insert(it.name(), it.attribute());
+        }
+    }
+}
+
+
 /*virtual*/
 void
 DeepImageOutputTile::setOutputFile (const char* filename,
-                                    Imf::LineOrder line_order)
+                                    Imf::LineOrder line_order,
+                                    Imf::Compression compression,
+                                    const Imf::Header* attributes)
 {
     if (!filename || !filename[0] || m_filename == filename)
         return;
     m_filename = filename;
+    flush(); // finish the current file first
 
     // Flip line order to match Y-up mode:
     if (line_order == Imf::DECREASING_Y)
@@ -733,33 +910,8 @@ DeepImageOutputTile::setOutputFile (const char* filename,
                        1.0,/*pixelAspectRatio*/
                        IMATH_NAMESPACE::V2f(0.0f, 0.0f), /*screenWindowCenter*/
                        1.0f, /*screenWindowWidth*/
-                       line_order,
-                       Imf::ZIPS_COMPRESSION); // Single-line zip for deep (TODO always...?)
-
-    ChannelSet write_channels(m_channels);
-    //write_channels -= Mask_SpMask8;
-    //write_channels -= Mask_DeepFlags;
-
-    foreach_channel(z, write_channels)
-    {
-        const ChannelAlias* c = getChannelAlias(*z);
-#ifdef DEBUG
-        assert(c); // shouldn't happen...
-#endif
-
-        // Use the fileIOName for EXR output channel name:
-        header.channels().insert(c->fileIOName(), Imf::Channel(c->fileIOPixelType()));
-    }
-
-#if 0
-    if (m_channels.contains(Mask_SpMask8))
-    {
-        header.channels().insert("spmask.1", Imf::Channel(Imf::FLOAT));
-        header.channels().insert("spmask.2", Imf::Channel(Imf::FLOAT));
-    }
-    if (m_channels.contains(Mask_DeepFlags))
-        header.channels().insert("spmask.flags", Imf::Channel(Imf::HALF));
-#endif
+                       line_order);
+    initOutputHeader(header, compression, attributes);
 
     delete m_file;
     m_file = new Imf::DeepScanLineOutputFile(filename, header);
@@ -772,11 +924,6 @@ DeepImageOutputTile::setOutputFile (const char* filename,
 // If flush_line is true the DeepLine memory is freed.
 //
 
-typedef std::vector<DeepImageOutputTile::HalfVec>  HalfSamples;
-typedef std::vector<DeepImageOutputTile::FloatVec> FloatSamples;
-typedef std::vector<DeepImageOutputTile::UintVec>  UintSamples;
-
-
 /*virtual*/
 void
 DeepImageOutputTile::writeScanline (int y,
@@ -785,33 +932,92 @@ DeepImageOutputTile::writeScanline (int y,
     if (!m_file || y < m_data_window.min.y || y > m_data_window.max.y)
         return; // don't crash...  TODO: throw exception?
 
-    y -= m_data_window.min.y;
-    const DeepLine* dl = m_deep_lines[y];
-    if (!dl)
-        return; // nothing to write
+    // An untouched line still has to be written (with no samples) to keep
+    // the following lines in place:
+    if (!createDeepLine(y))
+        return; // don't crash...
 
-    // Unpack the floats to arrays of the appropriate pixel types and
-    // assign the frambuffer slices to them:
-    const size_t nChannels = m_channel_aliases.size();
-    if (nChannels == 0)
+    m_pending_lines.push_back(y - m_data_window.min.y);
+    m_pending_flush.push_back(flush_line);
+
+    if ((int)m_pending_lines.size() >= batchLines())
+        writePendingLines();
+}
+
+
+int
+DeepImageOutputTile::batchLines () const
+{
+    if (m_write_batch_lines > 0)
+        return m_write_batch_lines;
+    // Give each OpenEXR thread a couple of lines to compress:
+    return std::max(1, 2*Imf::globalThreadCount());
+}
+
+
+/*virtual*/
+void
+DeepImageOutputTile::flush ()
+{
+    writePendingLines();
+}
+
+
+//
+// Write the buffered DeepLines to the file in one writePixels() call so
+// OpenEXR can compress them in parallel.  The framebuffer slices point
+// straight into the packed sample arrays, only the channels that aren't
+// float are converted.
+//
+
+void
+DeepImageOutputTile::writePendingLines ()
+{
+    const int nLines = (int)m_pending_lines.size();
+    if (!m_file || nLines == 0)
         return;
 
-    const size_t nPixels = dl->samples_per_pixel.size();
-#ifdef DEBUG
-    assert(nPixels == this->w());
-#endif
+    const size_t nChannels = m_channel_aliases.size();
+    const int width = this->w();
+
+    // Lines are written in the file's line order starting at its current
+    // line, find the file line of each buffered line's row:
+    const bool decreasing = (m_file->header().lineOrder() == Imf::DECREASING_Y);
+    const int file_y0 = (decreasing)?(m_file->currentScanLine() - nLines + 1):m_file->currentScanLine();
+    std::vector<const DeepLine*> lines(nLines);
+    for (int i=0; i < nLines; ++i)
+        lines[(decreasing)?(nLines - 1 - i):i] = m_deep_lines[m_pending_lines[i]];
+
+    // Sample counts of all the lines, and each line's first sample in a
+    // buffer holding them all:
+    m_count_buffer.resize(size_t(nLines)*width);
+    std::vector<uint32_t> line_offsets(nLines);
+    uint32_t nSamples = 0;
+    for (int j=0; j < nLines; ++j)
+    {
+        const DeepLine* dl = lines[j];
+        std::copy(dl->samples_per_pixel.begin(), dl->samples_per_pixel.end(), m_count_buffer.begin() + size_t(j)*width);
+        line_offsets[j] = nSamples;
+        if (width > 0)
+            nSamples += dl->floatOffset(width-1) + dl->samples_per_pixel[width-1];
+    }
 
-    // Unpacked sample data storage (only some of these actually get filled in):
-    std::vector<HalfSamples>   half_samples(nChannels);
-    std::vector<FloatSamples> float_samples(nChannels);
-    std::vector<UintSamples>   uint_samples(nChannels);
-    std::vector<PtrVec>           data_ptrs(nChannels);
+    // Slices address file pixels so offset the bases to the batch's first pixel:
+    const ptrdiff_t base_offset = ptrdiff_t(file_y0)*width + m_data_window.min.x;
 
     Imf::DeepFrameBuffer fb;
     fb.insertSampleCountSlice(Imf::Slice(Imf::UINT, 
-                                         (char*)(dl->samples_per_pixel.data() - m_data_window.min.x),
+                                         (char*)(m_count_buffer.data() - base_offset),
                                          sizeof(uint32_t)/*xStride*/,
-                                         0/*yStride*/));
+                                         sizeof(uint32_t)*width/*yStride*/));
+
+    // Conversion and pointer storage is kept between batches so it's only
+    // allocated once:
+    m_half_buffers.resize(nChannels);
+    m_uint_buffers.resize(nChannels);
+    m_ptr_buffers.resize(nChannels);
+
+    static float empty_sample = 0.0f; // always point to valid data, even for 0 samples...
 
     int chan_index = 0;
     size_t sample_stride = 0;
@@ -822,25 +1028,26 @@ DeepImageOutputTile::writeScanline (int y,
         assert(c); // shouldn't happen...
 #endif
 
-        const float* IN = dl->channel_arrays[chan_index].data();
-
-        PtrVec& ptrs = data_ptrs[chan_index];
-        ptrs.resize(nPixels);
+        PtrVec& ptrs = m_ptr_buffers[chan_index];
+        ptrs.resize(size_t(nLines)*width);
 
-        switch (c->fileIOPixelType())
+        const Imf::PixelType type = m_file_types[chan_index];
+        switch (type)
         {
             case Imf::HALF:
             {
-                HalfSamples& value_lists = half_samples[chan_index];
-                value_lists.resize(nPixels);
-                for (size_t i=0; i < nPixels; ++i)
+                HalfVec& samples = m_half_buffers[chan_index];
+                samples.resize(std::max(nSamples, uint32_t(1)));
+                for (int j=0; j < nLines; ++j)
                 {
-                    const size_t nSamples = dl->samples_per_pixel[i];
-                    HalfVec& samples = value_lists[i];
-                    samples.reserve(nSamples);
-                    for (size_t s=0; s < nSamples; ++s)
-                        samples.push_back(half(*IN++));
-                    ptrs[i] = samples.data(); // always point to valid data, even for 0 samples...
+                    const FloatVec& values = lines[j]->channel_arrays[chan_index];
+                    half* OUT = &samples[0] + line_offsets[j];
+                    const size_t nValues = values.size();
+                    for (size_t s=0; s < nValues; ++s)
+                        OUT[s] = half(values[s]);
+                    void** P = &ptrs[size_t(j)*width];
+                    for (int i=0; i < width; ++i)
+                        P[i] = OUT + lines[j]->floatOffset(i);
                 }
                 sample_stride = sizeof(half);
                 break;
@@ -848,16 +1055,14 @@ DeepImageOutputTile::writeScanline (int y,
 
             case Imf::FLOAT:
             {
-                FloatSamples& value_lists = float_samples[chan_index];
-                value_lists.resize(nPixels);
-                for (size_t i=0; i < nPixels; ++i)
+                // No conversion, OpenEXR reads the packed arrays directly:
+                for (int j=0; j < nLines; ++j)
                 {
-                    const size_t nSamples = dl->samples_per_pixel[i];
-                    FloatVec& samples = value_lists[i];
-                    samples.reserve(nSamples);
-                    for (size_t s=0; s < nSamples; ++s)
-                        samples.push_back(*IN++);
-                    ptrs[i] = samples.data(); // always point to valid data, even for 0 samples...
+                    const FloatVec& values = lines[j]->channel_arrays[chan_index];
+                    float* IN = (values.empty())?&empty_sample:const_cast<float*>(values.data());
+                    void** P = &ptrs[size_t(j)*width];
+                    for (int i=0; i < width; ++i)
+                        P[i] = (values.empty())?IN:(IN + lines[j]->floatOffset(i));
                 }
                 sample_stride = sizeof(float);
                 break;
@@ -865,16 +1070,18 @@ DeepImageOutputTile::writeScanline (int y,
 
             case Imf::UINT:
             {
-                UintSamples& value_lists = uint_samples[chan_index];
-                value_lists.resize(nPixels);
-                for (size_t i=0; i < nPixels; ++i)
+                UintVec& samples = m_uint_buffers[chan_index];
+                samples.resize(std::max(nSamples, uint32_t(1)));
+                for (int j=0; j < nLines; ++j)
                 {
-                    const size_t nSamples = dl->samples_per_pixel[i];
-                    UintVec& samples = value_lists[i];
-                    samples.reserve(nSamples);
-                    for (size_t s=0; s < nSamples; ++s, ++IN)
-                        samples.push_back(int(floorf((*IN < 0.0f)?0.0f:*IN)));
-                    ptrs[i] = samples.data();
+                    const FloatVec& values = lines[j]->channel_arrays[chan_index];
+                    uint32_t* OUT = &samples[0] + line_offsets[j];
+                    const size_t nValues = values.size();
+                    for (size_t s=0; s < nValues; ++s)
+                        OUT[s] = int(floorf((values[s] < 0.0f)?0.0f:values[s]));
+                    void** P = &ptrs[size_t(j)*width];
+                    for (int i=0; i < width; ++i)
+                        P[i] = OUT + lines[j]->floatOffset(i);
                 }
                 sample_stride = sizeof(uint32_t);
                 break;
@@ -887,25 +1094,30 @@ DeepImageOutputTile::writeScanline (int y,
                 break;
         }
 
-        fb.insert(c->fileIOName(), Imf::DeepSlice(c->fileIOPixelType(),
-                                                  (char*)(ptrs.data() - m_data_window.min.x),
+        fb.insert(c->fileIOName(), Imf::DeepSlice(type,
+                                                  (char*)(ptrs.data() - base_offset),
                                                   sizeof(void*)/*xStride*/,
-                                                  0/*yStride*/,
+                                                  sizeof(void*)*width/*yStride*/,
                                                   sample_stride/*sampleStride*/));
 
         ++chan_index;
     }
 
-    // Write line to file:
+    // Write lines to file:
     m_file->setFrameBuffer(fb);
-    m_file->writePixels( 1/*nLines*/ );
+    m_file->writePixels(nLines);
 
-    // Free the DeepLine:
-    if (flush_line)
+    // Free the DeepLines:
+    for (int i=0; i < nLines; ++i)
     {
-        delete m_deep_lines[y];
-        m_deep_lines[y] = 0;
+        if (m_pending_flush[i])
+        {
+            delete m_deep_lines[m_pending_lines[i]];
+            m_deep_lines[m_pending_lines[i]] = 0;
+        }
     }
+    m_pending_lines.clear();
+    m_pending_flush.clear();
 }
 
 //
@@ -917,8 +1129,9 @@ DeepImageOutputTile::writeScanline (int y,
 void
 DeepImageOutputTile::writeTile (bool flush_tile)
 {
-    for (int y=m_data_window.min.y; y < m_data_window.max.y; ++y)
+    for (int y=m_data_window.min.y; y <= m_data_window.max.y; ++y)
         writeScanline(y, flush_tile);
+    flush();
 }
 
 
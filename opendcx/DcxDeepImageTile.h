@@ -55,6 +55,7 @@
 #include <OpenEXR/ImfDeepImage.h>
 #include <OpenEXR/ImfDeepImageLevel.h>
 #include <OpenEXR/ImfDeepScanLineOutputFile.h>
+#include <OpenEXR/ImfHeader.h>
 
 #ifdef DEBUG
 #  include <assert.h>
@@ -91,10 +92,14 @@ class DCX_EXPORT DeepImageInputTile : public DeepTile
     // Constructs from a DeepImage (level 0) - assumes the
     // displayWindow == dataWindow.
     //
+    // If 'read_channels' is not empty only those channels (plus the depth
+    // and deep metadata channels) are mapped and copied into DeepPixels.
+    //
 
     DeepImageInputTile (const OPENEXR_IMF_NAMESPACE::DeepImage& image,
                         ChannelContext& channel_ctx,
-                        bool tileYup=true);
+                        bool tileYup=true,
+                        const ChannelSet& read_channels=Mask_None);
 
     //
     // Constructs from a DeepImage (level 0) and copies the displayWindow from
@@ -106,7 +111,8 @@ class DCX_EXPORT DeepImageInputTile : public DeepTile
     DeepImageInputTile (const OPENEXR_IMF_NAMESPACE::Header& header,
                         const OPENEXR_IMF_NAMESPACE::DeepImage& image,
                         ChannelContext& channel_ctx,
-                        bool tileYup=true);
+                        bool tileYup=true,
+                        const ChannelSet& read_channels=Mask_None);
 
 
     //
@@ -116,6 +122,15 @@ class DCX_EXPORT DeepImageInputTile : public DeepTile
     bool updateChannelPtrs ();
 
 
+    //
+    // Limit the channels read from the DeepImage to 'read_channels' plus
+    // the depth and deep metadata channels.  An empty set reads them all.
+    //
+
+    void setReadChannels (const ChannelSet& read_channels);
+    const ChannelSet& readChannels () const;
+
+
     //
     // Returns the number of deep samples at pixel x,y.
     //
@@ -140,6 +155,32 @@ class DCX_EXPORT DeepImageInputTile : public DeepTile
 
   protected:
 
+    //
+    // A mapped channel with its pixel type resolved, so whole-pixel reads
+    // don't switch on the type for every sample.
+    //
+
+    struct ChannelReader
+    {
+        Dcx::ChannelIdx                                 channel;
+        const OPENEXR_IMF_NAMESPACE::DeepImageChannel*  ptr;
+        OPENEXR_IMF_NAMESPACE::PixelType                type;
+
+        ChannelReader (Dcx::ChannelIdx _channel,
+                       const OPENEXR_IMF_NAMESPACE::DeepImageChannel* _ptr);
+
+        //
+        // Convert the first 'nSamples' samples of pixel x,y (file coordinates)
+        // to floats.
+        //
+
+        void    read (int x,
+                      int y,
+                      size_t nSamples,
+                      float* values) const;
+    };
+
+
     //
     // Copy constructor for subclasses
     //
@@ -158,6 +199,9 @@ class DCX_EXPORT DeepImageInputTile : public DeepTile
 
     const OPENEXR_IMF_NAMESPACE::DeepImageLevel* m_image_level;         // The image level
     std::vector<const OPENEXR_IMF_NAMESPACE::DeepImageChannel*> m_chan_ptrs;  // Per-ChannelIdx channel data ptrs
+    Dcx::ChannelSet     m_read_channels;                                // Channels to read, empty for all
+    std::vector<ChannelReader>  m_readers;                              // Mapped channels in m_channels order
+    std::vector<int>            m_reader_index;                         // Per-ChannelIdx index into m_readers, -1 if none
 
 };
 
@@ -169,6 +213,13 @@ class DCX_EXPORT DeepImageInputTile : public DeepTile
 //
 //      Adapter class for an output DeepImage tile.
 //
+//      Each line's samples are packed per channel in a DeepLine. Writing
+//      a line's pixels left to right appends to the packed arrays, which
+//      is linear in the line's sample count. Writing to the left of a
+//      pixel that's already written inserts into the arrays instead. The
+//      WRITE_RANDOM_SCANLINE and WRITE_SEQUENTIAL modes promise the
+//      append-only order; WRITE_RANDOM allows either.
+//
 //
 //      TODO: support multiple DeepImages/Headers so that multiple Parts
 //      can be combined into a single DeepPixel.
@@ -190,10 +241,14 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
         ChannelSet            channels;             // Channels which are in packed array
         std::vector<FloatVec> channel_arrays;       // Packed channel data for entire line
         std::vector<uint32_t> samples_per_pixel;    // Per-pixel sample count
+        std::vector<uint32_t> pixel_offsets;        // Prefix sums of samples_per_pixel, valid below append_start
+        uint32_t              append_start;         // Pixels from here on have never been written
 
         DeepLine (uint32_t width, const ChannelSet& _channels);
 
         uint32_t floatOffset (uint32_t xoffset) const;   // Get offset into channel_arrays for line x-offset
+        void     shiftOffsets (uint32_t xoffset,
+                               int32_t delta);           // Call after changing samples_per_pixel[xoffset] by delta
 
         void get (int xoffset,
                   Dcx::DeepPixel& deep_pixel) const;
@@ -202,6 +257,8 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
                          Dcx::DeepMetadata& metadata) const;
         void set (int xoffset,
                   const Dcx::DeepPixel& deep_pixel);
+        void append (int xoffset,
+                     const Dcx::DeepPixel& deep_pixel);    // xoffset must be >= append_start
         void clear (int xoffset);
     };
 
@@ -217,14 +274,17 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
                          bool sourceWindowsYup,
                          const ChannelAliasPtrSet& channels,
                          ChannelContext& channel_ctx,
-                         bool tileYup=true);
+                         bool tileYup=true,
+                         WriteAccessMode write_access_mode=WRITE_RANDOM);
 
     //
     // Copy resolution and channel info from another DeepTile.
-    // No pixel data is copied.
+    // No pixel data is copied, and the write access mode is not copied
+    // since the source is usually a read-only input tile.
     //
 
-    DeepImageOutputTile (const DeepTile& tile);
+    DeepImageOutputTile (const DeepTile& tile,
+                         WriteAccessMode write_access_mode=WRITE_RANDOM);
     ~DeepImageOutputTile ();
 
 
@@ -275,14 +335,33 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
     /*virtual*/ bool clearDeepPixel (int x,
                                      int y);
 
+    //
+    // Override the file pixel type of channel z, ex. HALF for AOVs.  By
+    // default channels are written with their alias' fileIOPixelType().
+    // Takes effect on the next setOutputFile().
+    //
+
+    void            setOutputPixelType (ChannelIdx z,
+                                        OPENEXR_IMF_NAMESPACE::PixelType type);
+    void            clearOutputPixelTypes ();
+    OPENEXR_IMF_NAMESPACE::PixelType outputPixelType (ChannelIdx z) const;
+
+
     //
     // Create an output deep file linked to this tile - destructive!
     // Will allocate a new Imf::DeepScanLineOutputFile and assign its
     // channels, destroying any current file.
+    // Deep files only support NONE, RLE, ZIPS and ZIP compression, any other
+    // is replaced with ZIPS.  If 'attributes' is not null its attributes
+    // are copied to the file header, except the ones describing the image
+    // layout which come from this tile (ex. copy the source file's header
+    // to pass through its metadata.)
     //
 
     virtual void    setOutputFile (const char* filename,
-                                   OPENEXR_IMF_NAMESPACE::LineOrder line_order=OPENEXR_IMF_NAMESPACE::INCREASING_Y);
+                                   OPENEXR_IMF_NAMESPACE::LineOrder line_order=OPENEXR_IMF_NAMESPACE::INCREASING_Y,
+                                   OPENEXR_IMF_NAMESPACE::Compression compression=OPENEXR_IMF_NAMESPACE::ZIPS_COMPRESSION,
+                                   const OPENEXR_IMF_NAMESPACE::Header* attributes=0);
 
 
     //
@@ -290,13 +369,33 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
     // specified in setOutputFile otherwise image will be upside-down.  ex. if
     // write line order is 0-100 use INCREASING_Y.  RANDOM_Y writing is only
     // supported for tiled images.
-    // If flush_line is true the DeepLine memory is freed.
+    // Lines are buffered and written writeBatchLines() at a time so OpenEXR
+    // can compress them in parallel - don't change a line after passing it
+    // here.  Call flush() after the last line to write any remainder.
+    // If flush_line is true the DeepLine memory is freed once it's written.
     //
 
     virtual void    writeScanline (int y,
                                    bool flush_line=true);
 
 
+    //
+    // Write any lines buffered by writeScanline() to the output file.
+    //
+
+    virtual void    flush ();
+
+
+    //
+    // Number of lines writeScanline() buffers before writing them to the
+    // file in one call.  0 (the default) uses twice the OpenEXR global
+    // thread count, or 1 if OpenEXR threading is off.
+    //
+
+    void            setWriteBatchLines (int lines);
+    int             writeBatchLines () const;
+
+
     //
     // Write entire tile to output file.
     // If flush_tile is true all DeepLine memory is freed.
@@ -310,11 +409,27 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
     void        deleteDeepLines ();
     void        resizeDataWindow (const IMATH_NAMESPACE::Box2i& data_window);
     DeepLine*   createDeepLine (int y);
+    int         batchLines () const;
+    void        initOutputHeader (OPENEXR_IMF_NAMESPACE::Header& header,
+                                  OPENEXR_IMF_NAMESPACE::Compression compression,
+                                  const OPENEXR_IMF_NAMESPACE::Header* attributes);
+    void        writePendingLines ();
 
 
     std::vector<DeepLine*>          m_deep_lines;           // Channel data storage
     std::string                     m_filename;
     OPENEXR_IMF_NAMESPACE::DeepScanLineOutputFile* m_file;  // Output file, if assigned
+    std::map<ChannelIdx, OPENEXR_IMF_NAMESPACE::PixelType> m_output_types; // Pixel type overrides
+    std::vector<OPENEXR_IMF_NAMESPACE::PixelType> m_file_types; // Current file's type for each channel, in channel order
+    int                             m_write_batch_lines;    // Lines per write, 0 for automatic
+    std::vector<int>                m_pending_lines;        // Tile lines waiting to be written, in write order
+    std::vector<bool>               m_pending_flush;        // Free the pending line after writing?
+
+    // Reusable writePendingLines() storage, one entry per channel:
+    std::vector<HalfVec>            m_half_buffers;         // Half-converted samples
+    std::vector<UintVec>            m_uint_buffers;         // Uint-converted samples
+    std::vector<PtrVec>             m_ptr_buffers;          // Per-pixel sample pointers
+    UintVec                         m_count_buffer;         // Sample counts of all pending lines
 
 };
 
@@ -327,6 +442,8 @@ class DCX_EXPORT DeepImageOutputTile : public DeepTile
 inline
 DeepImageInputTile::DeepImageInputTile (const DeepTile& b) : DeepTile(b) {}
 inline
+const ChannelSet& DeepImageInputTile::readChannels () const { return m_read_channels; }
+inline
 float DeepImageInputTile::getChannelSampleValueAt (int x,
                                                    int y,
                                                    size_t sample,
@@ -357,6 +474,10 @@ float DeepImageInputTile::getChannelSampleValueAt (int x,
 inline
 DeepImageOutputTile::DeepLine* DeepImageOutputTile::getLine(int y) const {
     return (y < m_data_window.min.y || y > m_data_window.max.y)?0:m_deep_lines[y - m_data_window.min.y]; }
+inline void DeepImageOutputTile::setWriteBatchLines (int lines) { m_write_batch_lines = (lines > 0)?lines:0; }
+inline int DeepImageOutputTile::writeBatchLines () const { return batchLines(); }
+inline void DeepImageOutputTile::setOutputPixelType (ChannelIdx z, OPENEXR_IMF_NAMESPACE::PixelType type) { m_output_types[z] = type; }
+inline void DeepImageOutputTile::clearOutputPixelTypes () { m_output_types.clear(); }
 //-----------------
 inline
 uint32_t
@@ -365,13 +486,20 @@ DeepImageOutputTile::DeepLine::floatOffset (uint32_t xoffset) const
 #ifdef DEBUG
     assert(xoffset < samples_per_pixel.size());
 #endif
-    uint32_t offset = 0;
-    const uint32_t* p = samples_per_pixel.data();
-    for (uint32_t i=0; i < xoffset; ++i)
-        offset += *p++;
-    return offset;
+    if (xoffset < append_start)
+        return pixel_offsets[xoffset];
+    // Pixels from append_start on are empty so they all start at the end
+    // of the samples:
+    return (append_start > 0)?(pixel_offsets[append_start-1] + samples_per_pixel[append_start-1]):0;
+}
+inline
+void
+DeepImageOutputTile::DeepLine::shiftOffsets (uint32_t xoffset,
+                                             int32_t delta)
+{
+    for (uint32_t i=xoffset+1; i < append_start; ++i)
+        pixel_offsets[i] += delta;
 }
-
 
 OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
 
@@ -234,8 +234,13 @@ DeepPixel::clear ()
 {
     m_segments.clear();
     m_pixels.clear();
+    m_sorted_Zf.clear();
+    m_sorted_Zb.clear();
+    m_sorted_spmasks.clear();
+    m_sorted_flags.clear();
 
     m_sorted = m_overlaps = false;
+    m_overlap_mask = SpMask8::zeroCoverage;
     m_accum_or_mask  = m_accum_and_mask  = SpMask8::zeroCoverage;
     m_accum_or_flags = m_accum_and_flags = DEEP_EMPTY_FLAG;
 }
@@ -263,6 +268,7 @@ DeepPixel::append (const DeepSegment& bs,
     m_segments[new_segment].index = (int)new_pixel;
 
     m_sorted = m_overlaps = false;
+    m_overlap_mask = SpMask8::zeroCoverage;
     m_accum_or_mask  = m_accum_and_mask  = SpMask8::zeroCoverage;
     m_accum_or_flags = m_accum_and_flags = DEEP_EMPTY_FLAG;
 
@@ -340,6 +346,7 @@ DeepPixel::append (const DeepPixel& b)
         m_pixels[m_pixels.size()-1].channels = m_channels;
     }
     m_sorted = m_overlaps = false;
+    m_overlap_mask = SpMask8::zeroCoverage;
     m_accum_or_mask  = m_accum_and_mask  = SpMask8::zeroCoverage;
     m_accum_or_flags = m_accum_and_flags = DEEP_EMPTY_FLAG;
 }
@@ -374,7 +381,8 @@ DeepPixel::nearestSegment (double Z,
 
 //
 //  Sort the segments.  If the sorted flag is true this returns quickly.
-//  This also updates global overlap and coverage flags.
+//  This also updates global overlap and coverage flags, the per-subpixel
+//  overlap mask, and the packed Zf/Zb/spmask/flags arrays.
 //
 
 void
@@ -383,33 +391,90 @@ DeepPixel::sort (bool force)
     if (m_sorted && !force)
         return;
     m_overlaps = false;
-    m_accum_or_mask   = m_accum_and_mask  = SpMask8::zeroCoverage;
-    m_accum_and_flags = m_accum_and_flags = DEEP_EMPTY_FLAG;
+    m_overlap_mask = SpMask8::zeroCoverage;
+    m_accum_or_mask  = m_accum_and_mask  = SpMask8::zeroCoverage;
+    m_accum_or_flags = m_accum_and_flags = DEEP_EMPTY_FLAG;
     const size_t nSegments = m_segments.size();
+    m_sorted_Zf.resize(nSegments);
+    m_sorted_Zb.resize(nSegments);
+    m_sorted_spmasks.resize(nSegments);
+    m_sorted_flags.resize(nSegments);
     if (nSegments > 0)
     {
         // Sort the segments:
         std::sort(m_segments.begin(), m_segments.end());
 
+        // Copy out the packed arrays:
+        for (size_t i=0; i < nSegments; ++i)
+        {
+            const DeepSegment& segment = m_segments[i];
+            m_sorted_Zf[i]      = segment.Zf;
+            m_sorted_Zb[i]      = segment.Zb;
+            m_sorted_spmasks[i] = segment.metadata.spmask;
+            m_sorted_flags[i]   = segment.metadata.flags;
+        }
+
         // Determine global overlap and coverage status:
         m_accum_and_mask  = SpMask8::fullCoverage;
         m_accum_and_flags = DEEP_ALL_FLAGS;
-        float prev_Zf = -INFINITYf;
-        float prev_Zb = -INFINITYf;
-        for (size_t i=0; i < nSegments; ++i)
+        const float* Zf = &m_sorted_Zf[0];
+        const float* Zb = &m_sorted_Zb[0];
+        for (size_t i=1; i < nSegments; ++i)
         {
-            const DeepSegment& segment = m_segments[i];
-            if (segment.Zf < prev_Zf || segment.Zb < prev_Zf ||
-                segment.Zf < prev_Zb || segment.Zb < prev_Zb)
+            if (Zf[i] < Zf[i-1] || Zb[i] < Zf[i-1] ||
+                Zf[i] < Zb[i-1] || Zb[i] < Zb[i-1])
+            {
                 m_overlaps = true;
+                break;
+            }
+        }
+        for (size_t i=0; i < nSegments; ++i)
+        {
+            m_accum_or_mask   |= m_sorted_spmasks[i];
+            m_accum_and_mask  &= m_sorted_spmasks[i];
+            m_accum_or_flags  |= m_sorted_flags[i];
+            m_accum_and_flags &= m_sorted_flags[i];
+        }
 
-            m_accum_or_mask   |= segment.spMask();
-            m_accum_and_mask  &= segment.spMask();
-            m_accum_or_flags  |= segment.flags();
-            m_accum_and_flags &= segment.flags();
-
-            prev_Zf = segment.Zf;
-            prev_Zb = segment.Zb;
+        // Determine which subpixel bins have overlaps.  Any overlap within a bin
+        // also shows up between neighboring segments in the full list, so there's
+        // nothing to do if the global check found none:
+        if (m_overlaps)
+        {
+            if (m_accum_or_mask == SpMask8::zeroCoverage || m_accum_and_mask == SpMask8::fullCoverage)
+            {
+                // All segments are in all bins:
+                m_overlap_mask = SpMask8::fullCoverage;
+            }
+            else
+            {
+                float prev_Zf[SpMask8::numBits];
+                float prev_Zb[SpMask8::numBits];
+                int32_t overlapped[SpMask8::numBits];
+                std::fill(prev_Zf, prev_Zf+SpMask8::numBits, -INFINITYf);
+                std::fill(prev_Zb, prev_Zb+SpMask8::numBits, -INFINITYf);
+                std::fill(overlapped, overlapped+SpMask8::numBits, 0);
+                for (size_t i=0; i < nSegments; ++i)
+                {
+                    const uint64_t bits = (m_sorted_spmasks[i] == SpMask8::zeroCoverage)?
+                                            ~0ull:m_sorted_spmasks[i].value();
+                    const float Zf_i = Zf[i];
+                    const float Zb_i = Zb[i];
+                    for (int b=0; b < SpMask8::numBits; ++b)
+                    {
+                        const int32_t on = -int32_t((bits >> b) & 1ull);
+                        const int32_t overlap = -int32_t(Zf_i < prev_Zf[b]) | -int32_t(Zb_i < prev_Zf[b]) |
+                                                -int32_t(Zf_i < prev_Zb[b]) | -int32_t(Zb_i < prev_Zb[b]);
+                        overlapped[b] |= (on & overlap);
+                        prev_Zf[b] = (on)?Zf_i:prev_Zf[b];
+                        prev_Zb[b] = (on)?Zb_i:prev_Zb[b];
+                    }
+                }
+                uint64_t overlap_bits = 0ull;
+                for (int b=0; b < SpMask8::numBits; ++b)
+                    overlap_bits |= uint64_t(overlapped[b] & 1) << b;
+                m_overlap_mask = SpMask8(overlap_bits);
+            }
         }
     }
     m_sorted = true;
@@ -435,19 +500,28 @@ DeepPixel::hasOverlaps (const SpMask8& spmask,
     // If full coverage then we can return the global overlap indicator:
     if (spmask == SpMask8::fullCoverage || allFullCoverage() || isLegacyDeepPixel())
         return m_overlaps;
-    // Determine the overlap status for the spmask:
+    // Any overlapping bin in the spmask means the spmask overlaps, and for a
+    // single bin that's the whole answer:
+    if (!m_overlaps || (spmask & m_overlap_mask) != SpMask8::zeroCoverage)
+        return m_overlaps;
+    if (spmask != SpMask8::zeroCoverage && (spmask.value() & (spmask.value() - 1ull)) == 0ull)
+        return false;
+    // Otherwise segments in different bins of the spmask may still overlap
+    // each other, determine the overlap status for the whole spmask:
+    const float* Zf = &m_sorted_Zf[0];
+    const float* Zb = &m_sorted_Zb[0];
+    const SpMask8* spmasks = &m_sorted_spmasks[0];
     float prev_Zf = -INFINITYf;
     float prev_Zb = -INFINITYf;
     for (size_t i=0; i < nSegments; ++i)
     {
-        const DeepSegment& segment = m_segments[i];
-        if (segment.maskBitsEnabled(spmask))
+        if (spmasks[i] == SpMask8::zeroCoverage || (spmasks[i] & spmask))
         {
-            if (segment.Zf < prev_Zf || segment.Zb < prev_Zf ||
-                segment.Zf < prev_Zb || segment.Zb < prev_Zb)
+            if (Zf[i] < prev_Zf || Zb[i] < prev_Zf ||
+                Zf[i] < prev_Zb || Zb[i] < prev_Zb)
                 return true;
-            prev_Zf = segment.Zf;
-            prev_Zb = segment.Zb;
+            prev_Zf = Zf[i];
+            prev_Zb = Zb[i];
         }
     }
     return false;
@@ -517,6 +591,203 @@ DeepPixel::isLegacyDeepPixel ()
 //-------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------
 
+//
+// Per-bin accumulators for the single-sweep subpixel flattener.
+//
+// Each lane holds the flattenNoOverlaps() result for one class of subpixel bins that
+// see the same segments. Values are stored slot-major (all lanes of a channel are
+// contiguous) so the per-segment lane loops can be vectorized with the segment's
+// class membership acting as the lane predicate.
+//
+
+struct SubpixelLanes
+{
+    enum { numLanes = SpMask8::numBits };
+
+    std::vector<ChannelIdx> chans;      // Slot channels - composited channels first, then extra outputs
+    size_t                  nComp;      // Number of composited channel slots
+    size_t                  sA, sZf, sZb, sCutoutA, sCutoutZ;
+    std::vector<float>      values;     // chans.size() * numLanes
+
+    size_t findSlot (ChannelIdx z)
+    {
+        for (size_t s=0; s < chans.size(); ++s)
+            if (chans[s] == z)
+                return s;
+        chans.push_back(z);
+        return chans.size()-1;
+    }
+
+    // Build the slots and initialize the lanes the same way flattenNoOverlaps()
+    // initializes its output pixel:
+    void init (const ChannelSet& comp_channels)
+    {
+        chans.clear();
+        foreach_channel(z, comp_channels)
+            chans.push_back(*z);
+        nComp    = chans.size();
+        sA       = findSlot(Chan_A);
+        sZf      = findSlot(Chan_ZFront);
+        sZb      = findSlot(Chan_ZBack);
+        sCutoutA = findSlot(Chan_CutoutA);
+        sCutoutZ = findSlot(Chan_CutoutZ);
+        values.resize(chans.size()*numLanes);
+        std::fill(values.begin(), values.end(), 0.0f);
+        std::fill(slot(sZf), slot(sZf)+numLanes,  INFINITYf);
+        std::fill(slot(sZb), slot(sZb)+numLanes, -INFINITYf);
+        std::fill(slot(sCutoutA), slot(sCutoutA)+numLanes, 0.0f);
+        std::fill(slot(sCutoutZ), slot(sCutoutZ)+numLanes, INFINITYf);
+    }
+
+    float* slot (size_t s) { return &values[s*numLanes]; }
+
+    // Copy one lane into an output pixel, matching what flattenNoOverlaps() would
+    // have left in it:
+    void get (int lane,
+              const ChannelSet& out_channels,
+              Pixelf& out)
+    {
+        out.erase(out_channels);
+        for (size_t s=0; s < chans.size(); ++s)
+            out[chans[s]] = values[s*numLanes + lane];
+    }
+};
+
+
+//
+// Two of these are created for each DeepSegment to track
+// the active segments.
+//
+
+enum { THIN_EDGE = -1, FRONT_EDGE = 0, BACK_EDGE = 1 };
+
+struct SegmentEdge
+{
+    float      depth;
+    uint32_t   segment;
+    int        type;
+
+    SegmentEdge(float _depth, uint32_t _segment, int _type) :
+        depth(_depth),
+        segment(_segment),
+        type(_type)
+    {
+        //
+    }
+
+    bool operator < (const SegmentEdge& b) const
+    {
+        if (depth   < b.depth  ) return true;
+        if (depth   > b.depth  ) return false;
+        if (segment < b.segment) return true;
+        if (segment > b.segment) return false;
+        return (type < b.type);
+    }
+};
+
+//
+// List of active segment indices, kept sorted in ascending order so it
+// iterates in the same order a std::set would.
+//
+
+typedef std::vector<uint32_t> SegmentEdgeSet;
+
+static inline void
+activateSegment (SegmentEdgeSet& active_segments,
+                 uint32_t segment)
+{
+    SegmentEdgeSet::iterator it = std::lower_bound(active_segments.begin(), active_segments.end(), segment);
+    if (it == active_segments.end() || *it != segment)
+        active_segments.insert(it, segment);
+}
+
+static inline void
+deactivateSegment (SegmentEdgeSet& active_segments,
+                   uint32_t segment)
+{
+    SegmentEdgeSet::iterator it = std::lower_bound(active_segments.begin(), active_segments.end(), segment);
+    if (it != active_segments.end() && *it == segment)
+        active_segments.erase(it);
+}
+
+
+//
+// Set a Pixel's channels the way the Pixel(ChannelSet) constructor does,
+// reusing its existing storage.
+//
+
+static inline void
+initScratchPixel (Pixelf& pixel,
+                  const ChannelSet& channels)
+{
+    pixel.channels = channels;
+    pixel.reserve(channels);
+}
+
+
+//
+// Copy a Pixel into a scratch list entry, only growing the list when 'index'
+// is past its end.  Entries are never released so their channel storage gets
+// reused.
+//
+
+static inline Pixelf&
+setScratchPixel (std::vector<Pixelf>& pixels,
+                 size_t index,
+                 const Pixelf& pixel)
+{
+    if (index < pixels.size())
+        pixels[index] = pixel;
+    else
+        pixels.push_back(pixel);
+    return pixels[index];
+}
+
+
+//
+// FlattenContext buffers.
+//
+
+struct FlattenContext::Scratch
+{
+    // flatten():
+    SubpixelLanes               lanes;              // Per-class accumulators
+    std::vector<Pixelf>         class_results;      // flattenOverlapping() result for each class
+    Pixelf                      flattened;          // Class result being accumulated
+
+    // flattenOverlapping():
+    std::vector<SegmentEdge>    segment_edges;
+    SegmentEdgeSet              active_segments;
+    std::vector<Pixelf>         sample_colors;
+    std::vector<Pixelf>         prev_colors;
+    Pixelf                      black_color;
+    Pixelf                      section_color;
+    Pixelf                      interp_color;
+    Pixelf                      merged_color;
+    Pixelf                      additive_color;
+};
+
+FlattenContext::FlattenContext () :
+    m_scratch(0)
+{
+    //
+}
+
+FlattenContext::~FlattenContext ()
+{
+    delete m_scratch;
+}
+
+FlattenContext::Scratch&
+FlattenContext::scratch ()
+{
+    if (!m_scratch)
+        m_scratch = new Scratch;
+    return *m_scratch;
+}
+
+
+
 //
 //  Flatten the DeepSegments down into the output Pixel using front-to-back UNDERs.
 //
@@ -524,7 +795,8 @@ DeepPixel::isLegacyDeepPixel ()
 void
 DeepPixel::flatten (const ChannelSet& out_channels,
                     Pixelf& out,
-                    InterpolationMode interpolation)
+                    InterpolationMode interpolation,
+                    FlattenContext* ctx)
 {
     const bool has_overlaps = hasOverlaps();
 #ifdef DCX_DEBUG_FLATTENER
@@ -547,7 +819,7 @@ DeepPixel::flatten (const ChannelSet& out_channels,
             flattenNoOverlaps(out_channels, out, SpMask8::fullCoverage);
         else
             // Merge overlapping deep segments:
-            flattenOverlapping(out_channels, out, SpMask8::fullCoverage, interpolation);
+            flattenOverlapping(out_channels, out, SpMask8::fullCoverage, interpolation, ctx);
         return;
     }
 
@@ -563,54 +835,298 @@ DeepPixel::flatten (const ChannelSet& out_channels,
     out[Chan_ZFront] =  INFINITYf;
     out[Chan_ZBack ] = -INFINITYf;
 
-    Pixelf flattened(out_channels);
-
-#if 0
-    // TODO: handle the Z accumulation with coverage weighting - i.e. pick Z from
-    //    the sample with largest coverage.
-    //    Finishing this code will likely produce more accurate flattened Z's
-    std::vector<int> frontmost_coverage;
-    frontmost_coverage.resize(this->size(), 0);
-#endif
+    // Rather than walking the segment list once per subpixel bin, the bins are
+    // partitioned into classes of bins that see exactly the same segments - these
+    // always flatten to the same result so each class only needs flattening once.
+    // The classes with no overlapping segments are composited together in a single
+    // front-to-back sweep with one accumulator lane per class.  Classes with
+    // overlaps still go through flattenOverlapping() individually.
+    const size_t nSegments = m_segments.size();
+    const float* Zf = &m_sorted_Zf[0];
+    const float* Zb = &m_sorted_Zb[0];
+    const SpMask8* spmasks = &m_sorted_spmasks[0];
+    const DeepFlag* flags = &m_sorted_flags[0];
+
+    // Split the bins into classes by segment membership, refining the classes
+    // by each distinct spmask until no segment partially covers a class.  Once
+    // there's more than half as many classes as bins further refining costs more
+    // than it saves, so give each bin its own class instead:
+    uint64_t class_bins[SubpixelLanes::numLanes];
+    class_bins[0] = ~0ull;
+    int nClasses = 1;
+    for (size_t i=0; i < nSegments; ++i)
+    {
+        if (nClasses > SubpixelLanes::numLanes/2)
+        {
+            for (int b=0; b < SubpixelLanes::numLanes; ++b)
+                class_bins[b] = (1ull << b);
+            nClasses = SubpixelLanes::numLanes;
+            break;
+        }
+        const uint64_t bits = spmasks[i].value();
+        if (bits == 0ull || bits == ~0ull || (i > 0 && spmasks[i] == spmasks[i-1]))
+            continue; // zero & full-coverage segments are in every bin
+        const int n = nClasses;
+        for (int c=0; c < n; ++c)
+        {
+            const uint64_t in_bins = class_bins[c] & bits;
+            if (in_bins != 0ull && in_bins != class_bins[c])
+            {
+                class_bins[nClasses++] = class_bins[c] & ~bits;
+                class_bins[c] = in_bins;
+            }
+        }
+    }
+    // Per-bin class index, and the first bin in each class:
+    uint8_t bin_class[SubpixelLanes::numLanes];
+    uint8_t class_bin[SubpixelLanes::numLanes];
+    for (int c=0; c < nClasses; ++c)
+    {
+        class_bin[c] = SubpixelLanes::numLanes;
+        for (int b=SubpixelLanes::numLanes-1; b >= 0; --b)
+        {
+            if (class_bins[c] & (1ull << b))
+            {
+                bin_class[b] = uint8_t(c);
+                class_bin[c] = uint8_t(b);
+            }
+        }
+    }
 
-    // If nearest cutout Z is in front of non-cutout, output INF:
-    float cutout_Z = INFINITYf;
+    // Find the classes with overlapping segments, all bins in a class share
+    // the same overlap state:
+    uint64_t overlap_classes = 0ull;
+    if (has_overlaps && interpolation != OPENDCX_INTERNAL_NAMESPACE::INTERP_OFF)
+    {
+        const uint64_t overlap_bins = m_overlap_mask.value();
+        for (int c=0; c < nClasses; ++c)
+            overlap_classes |= ((overlap_bins >> class_bin[c]) & 1ull) << c;
+    }
 
-    // Harcode for now:
-    const size_t subpixels_x = 8;
-    const size_t subpixels_y = 8;
+    // Get the channel set to composite:
+    ChannelSet comp_channels(out_channels);
+    comp_channels &= m_channels; // only bother compositing requested output channels
+    comp_channels += Chan_A;     // but, always composite alpha even if not requested
+    comp_channels -= Mask_Depth; // don't composite depth channels, we handle those separately
 
-    SpMask8 sp_mask(1ull);
-    size_t count = 0;
-    for (size_t sp_y=0; sp_y < subpixels_y; ++sp_y)
+    FlattenContext temp_ctx;
+    if (!ctx)
+        ctx = &temp_ctx;
+    FlattenContext::Scratch& scratch = ctx->scratch();
+
+    SubpixelLanes& lanes = scratch.lanes;
+    lanes.init(comp_channels);
+    float* lane_A  = lanes.slot(lanes.sA);
+    float* lane_Zf = lanes.slot(lanes.sZf);
+    float* lane_Zb = lanes.slot(lanes.sZb);
+    float* lane_CA = lanes.slot(lanes.sCutoutA);
+    float* lane_CZ = lanes.slot(lanes.sCutoutZ);
+
+    // Classes are 'done' when their alpha saturates or they're handled by flattenOverlapping():
+    const uint64_t all_classes = (nClasses == SubpixelLanes::numLanes)?~0ull:((1ull << nClasses) - 1ull);
+    uint64_t done_classes = overlap_classes;
+    for (size_t i=0; i < nSegments && done_classes != all_classes; ++i)
     {
-        for (size_t sp_x=0; sp_x < subpixels_x; ++sp_x)
+        const uint64_t bits = (spmasks[i] == SpMask8::zeroCoverage)?~0ull:spmasks[i].value();
+        // A segment covers either all or none of a class's bins, so checking the
+        // first bin of each class gives the classes it's in:
+        uint64_t member = bits;
+        if (nClasses < SubpixelLanes::numLanes)
         {
-            // Flatten just the segments that have their masks on for this subpixel:
-            flattenSubpixels(out_channels, flattened, sp_mask, interpolation);
-            // Add flattened subpixel color to accumulation pixel:
-            out += flattened;
-#if 1
-            if (flattened[Chan_CutoutZ] < INFINITYf)
-            {
-                // Flattened pixel has cutout in front, don't min accum chans:
-                cutout_Z = std::min(flattened[Chan_CutoutZ], cutout_Z);
+            member = 0ull;
+            for (int c=0; c < nClasses; ++c)
+                member |= ((bits >> class_bin[c]) & 1ull) << c;
+        }
+        const uint64_t live = member & ~done_classes & all_classes;
+        if (live == 0ull)
+            continue;
+        // Lane predicate - all bits set for the live classes:
+        int32_t on[SubpixelLanes::numLanes];
+        for (int b=0; b < nClasses; ++b)
+            on[b] = -int32_t((live >> b) & 1ull);
+
+        const Pixelf& color = getSegmentPixel(i);
+        const float color_A = color[Chan_A];
+        const bool additive = (flags[i] & (DEEP_ADDITIVE_SAMPLE | DEEP_PARTIAL_BIN_COVERAGE)) != 0;
 
+        if (flags[i] & DEEP_MATTE_OBJECT_SAMPLE)
+        {
+            // Matte object, color chans are black so just under alpha:
+            for (int b=0; b < nClasses; ++b)
+            {
+                if (!on[b])
+                    continue;
+                if (additive)
+                    lane_A[b] += color_A; // ADD
+                else
+                    lane_A[b] += color_A*(1.0f - lane_A[b]); // UNDER
+                // Only min the cutout Z if matte alpha is greater than the alpha threshold:
+                if (lane_A[b] >= EPSILONf && Zf[i] > 0.0f)
+                    lane_CZ[b] = std::min(Zf[i], lane_CZ[b]);
+            }
+        }
+        else
+        {
+            if (additive)
+            {
+                for (int b=0; b < nClasses; ++b)
+                {
+                    if (!on[b])
+                        continue;
+                    const float iBa = (1.0f - lane_A[b]);
+                    // Correct for alpha overshooting 1.0 and weigh additive contribution
+                    // down by the overshoot amount to avoid any brightening artifacts:
+                    if ((lane_A[b] + color_A) > 1.0f)
+                    {
+                        const float correction = (iBa / color_A);
+                        for (size_t s=0; s < lanes.nComp; ++s)
+                            if (s != lanes.sA)
+                                lanes.slot(s)[b] += color[lanes.chans[s]]*correction;
+                        lane_A[b] = lane_CA[b] = 1.0f;
+                    }
+                    else
+                    {
+                        for (size_t s=0; s < lanes.nComp; ++s)
+                            lanes.slot(s)[b] += color[lanes.chans[s]];
+                        lane_CA[b] += color_A;
+                    }
+                }
             }
             else
             {
-                //out[Chan_Z     ] = std::min(out[Chan_Z     ], flattened[Chan_Z     ]);
-                out[Chan_ZFront] = std::min(out[Chan_ZFront], flattened[Chan_ZFront]);
-                out[Chan_ZBack ] = std::min(out[Chan_ZBack ], flattened[Chan_ZBack ]);
+                // UNDER all the live lanes at once.  The lane weight is zero for
+                // the inactive lanes so the UNDER can run unconditionally, adding
+                // zero leaves the lane unchanged as long as the color is finite:
+                float iBa[SubpixelLanes::numLanes];
+                for (int b=0; b < nClasses; ++b)
+                {
+                    const float w = (1.0f - lane_A[b]);
+                    iBa[b] = (on[b])?w:0.0f;
+                }
+                for (size_t s=0; s <= lanes.nComp; ++s)
+                {
+                    // Last pass does the cutout alpha:
+                    const float v = (s < lanes.nComp)?color[lanes.chans[s]]:color_A;
+                    float* lane = (s < lanes.nComp)?lanes.slot(s):lane_CA;
+                    if (v - v == 0.0f)
+                    {
+                        for (int b=0; b < nClasses; ++b)
+                            lane[b] += v*iBa[b];
+                    }
+                    else
+                    {
+                        // Inf/nan color, only touch the active lanes:
+                        for (int b=0; b < nClasses; ++b)
+                            if (on[b])
+                                lane[b] += v*iBa[b];
+                    }
+                }
+            }
+
+            // Only min the Zs if undered alpha result is greater than the alpha threshold:
+            const float Zf_i = Zf[i];
+            const float Zb_i = Zb[i];
+            if (Zf_i > 0.0f)
+            {
+                for (int b=0; b < nClasses; ++b)
+                {
+                    const float Z = std::min(Zf_i, lane_Zf[b]);
+                    lane_Zf[b] = (on[b] & -int32_t(lane_A[b] >= EPSILONf))?Z:lane_Zf[b];
+                }
             }
-#else
-            // TODO: handle the Z accumulation with coverage weighting
-            frontmost_coverage[] = 
-#endif
-            //
-            ++sp_mask;
-            ++count;
+            if (Zb_i > 0.0f)
+            {
+                for (int b=0; b < nClasses; ++b)
+                {
+                    const float Z = std::max(Zb_i, lane_Zb[b]);
+                    lane_Zb[b] = (on[b] & -int32_t(lane_A[b] >= EPSILONf))?Z:lane_Zb[b];
+                }
+            }
+        }
+
+        // Stop compositing classes whose alpha has saturated:
+        uint64_t saturated = 0ull;
+        for (int b=0; b < nClasses; ++b)
+            saturated |= uint64_t(on[b] & -int32_t(lane_A[b] >= (1.0f - EPSILONf)) & 1) << b;
+        done_classes |= saturated;
+
+    } // nSegments
+
+    // Finish the lanes like flattenNoOverlaps() does:
+    for (int b=0; b < nClasses; ++b)
+    {
+        // If nearest cutout Z is in front of non-cutout, output INF:
+        if (lane_CZ[b] < lane_Zf[b])
+            lane_Zf[b] = lane_Zb[b] = INFINITYf;
+        else if (lane_Zb[b] < 0.0f)
+            lane_Zb[b] = INFINITYf;
+        // Final alpha is cutout-alpha channel:
+        lane_A[b] = (lane_CA[b] >= (1.0f - EPSILONf))?1.0f:lane_CA[b];
+    }
+
+    // Flatten the overlapping classes once each, using the first bin in the
+    // class as its subpixel mask:
+    std::vector<Pixelf>& class_results = scratch.class_results;
+    if (overlap_classes != 0ull)
+    {
+        if (class_results.size() < size_t(nClasses))
+            class_results.resize(nClasses);
+        for (int c=0; c < nClasses; ++c)
+        {
+            if (overlap_classes & (1ull << c))
+            {
+                initScratchPixel(class_results[c], out_channels);
+                flattenOverlapping(out_channels, class_results[c],
+                                   SpMask8(1ull << class_bin[c]), interpolation, ctx);
+            }
+        }
+    }
+
+    // Channels a flattened class result carries, including the ones that are
+    // filled in even when not enabled in out_channels:
+    ChannelSet result_channels(out_channels);
+    result_channels += Chan_A;
+    result_channels += Chan_ZFront;
+    result_channels += Chan_ZBack;
+    result_channels += Chan_CutoutA;
+    result_channels += Chan_CutoutZ;
+
+    Pixelf& flattened = scratch.flattened;
+    initScratchPixel(flattened, out_channels);
+
+    // If nearest cutout Z is in front of non-cutout, output INF:
+    float cutout_Z = INFINITYf;
+
+    // Accumulate the bins in order so the result matches flattening each
+    // subpixel separately:
+    size_t count = 0;
+    int prev_class = -1;
+    for (int b=0; b < SubpixelLanes::numLanes; ++b)
+    {
+        const int c = bin_class[b];
+        if (c != prev_class)
+        {
+            if (overlap_classes & (1ull << c))
+                flattened.replace(class_results[c], result_channels);
+            else
+                lanes.get(c, out_channels, flattened);
+            prev_class = c;
         }
+        // Add flattened subpixel color to accumulation pixel:
+        out += flattened;
+        if (flattened[Chan_CutoutZ] < INFINITYf)
+        {
+            // Flattened pixel has cutout in front, don't min accum chans:
+            cutout_Z = std::min(flattened[Chan_CutoutZ], cutout_Z);
+
+        }
+        else
+        {
+            //out[Chan_Z     ] = std::min(out[Chan_Z     ], flattened[Chan_Z     ]);
+            out[Chan_ZFront] = std::min(out[Chan_ZFront], flattened[Chan_ZFront]);
+            out[Chan_ZBack ] = std::min(out[Chan_ZBack ], flattened[Chan_ZBack ]);
+        }
+        ++count;
     }
 
     // If final cutout Z is in front of non-cutout Z, output INF:
@@ -648,7 +1164,8 @@ void
 DeepPixel::flattenSubpixels (const ChannelSet& out_channels,
                              Pixelf& out,
                              const SpMask8& spmask,
-                             InterpolationMode interpolation)
+                             InterpolationMode interpolation,
+                             FlattenContext* ctx)
 {
     // Must update the overlap state for each bin individually.  This returns
     // fast if global full coverage is on:
@@ -668,7 +1185,7 @@ DeepPixel::flattenSubpixels (const ChannelSet& out_channels,
         flattenNoOverlaps(out_channels, out, spmask);
     else
         // Merge overlapping deep segments:
-        flattenOverlapping(out_channels, out, spmask, interpolation);
+        flattenOverlapping(out_channels, out, spmask, interpolation, ctx);
 }
 
 //-------------------------------------------------------------------------------------
@@ -686,6 +1203,7 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
     // Always fill in these output channels even though they may not be enabled
     // in the output pixel's channel set:
     //out[Chan_Z      ] =  INFINITYf;
+    out[Chan_A      ] = 0.0f;
     out[Chan_ZFront ] =  INFINITYf;
     out[Chan_ZBack  ] = -INFINITYf;
     out[Chan_CutoutA] = 0.0f;
@@ -740,10 +1258,14 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
 
     // Put them in front to back order then composite using UNDER or PLUS operations:
     this->sort();
+    const float* Zf = &m_sorted_Zf[0];
+    const float* Zb = &m_sorted_Zb[0];
+    const SpMask8* spmasks = &m_sorted_spmasks[0];
+    const DeepFlag* flags = &m_sorted_flags[0];
     for (size_t i=0; i < nSegments; ++i)
     {
-        const DeepSegment& segment = m_segments[i];
 #ifdef DCX_DEBUG_FLATTENER
+        const DeepSegment& segment = m_segments[i];
         if (debug) {
             std::cout << "     " << i << std::fixed << ": Zf=" << segment.Zf << " Zb=" << segment.Zb;
             std::cout << " flags=("; segment.printFlags(std::cout); std::cout << ")";
@@ -751,7 +1273,7 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
 #endif
 
         // Skip segment if not in active spmask:
-        if (useSpMasks && !segment.maskBitsEnabled(spmask))
+        if (useSpMasks && !(spmasks[i] == SpMask8::zeroCoverage || (spmasks[i] & spmask)))
 #ifdef DCX_DEBUG_FLATTENER
         {
             if (debug) std::cout << " - subpixel OFF: skip it." << std::endl;
@@ -772,10 +1294,10 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
         const Pixelf& color = getSegmentPixel(i);
 
         // UNDER or ADD each color channel:
-        if (segment.isMatte())
+        if (flags[i] & DEEP_MATTE_OBJECT_SAMPLE)
         {
             // Matte object, color chans are black so just under alpha:
-            if (segment.isAdditive() || segment.hasPartialSubpixelBinCoverage())
+            if (flags[i] & (DEEP_ADDITIVE_SAMPLE | DEEP_PARTIAL_BIN_COVERAGE))
                 out[Chan_A] += color[Chan_A]; // ADD
             else
                 out[Chan_A] += color[Chan_A]*(1.0f - out[Chan_A]); // UNDER
@@ -783,15 +1305,15 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
             // Only min the cutout Z if matte alpha is greater than the alpha threshold:
             if (out[Chan_A] >= EPSILONf)
             {
-               if (segment.Zf > 0.0f)
-                  out[Chan_CutoutZ] = std::min(segment.Zf, out[Chan_CutoutZ]);
+               if (Zf[i] > 0.0f)
+                  out[Chan_CutoutZ] = std::min(Zf[i], out[Chan_CutoutZ]);
             }
 
         }
         else
         {
             const float iBa = (1.0f - out[Chan_A]);
-            if (segment.isAdditive() || segment.hasPartialSubpixelBinCoverage())
+            if (flags[i] & (DEEP_ADDITIVE_SAMPLE | DEEP_PARTIAL_BIN_COVERAGE))
             {
                 // Correct for alpha overshooting 1.0 and weigh additive contribution
                 // down by the overshoot amount to avoid any brightening artifacts:
@@ -819,10 +1341,10 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
             // Only min the Zs if undered alpha result is greater than the alpha threshold:
             if (out[Chan_A] >= EPSILONf)
             {
-                if (segment.Zf > 0.0f)
-                    /*out[Chan_Z] = */out[Chan_ZFront] = std::min(segment.Zf, out[Chan_ZFront]);
-                if (segment.Zb > 0.0f)
-                    out[Chan_ZBack] = std::max(segment.Zb, out[Chan_ZBack]);
+                if (Zf[i] > 0.0f)
+                    /*out[Chan_Z] = */out[Chan_ZFront] = std::min(Zf[i], out[Chan_ZFront]);
+                if (Zb[i] > 0.0f)
+                    out[Chan_ZBack] = std::max(Zb[i], out[Chan_ZBack]);
             }
 
         }
@@ -860,42 +1382,6 @@ DeepPixel::flattenNoOverlaps (const ChannelSet& out_channels,
 } // DeepPixel::flattenNoOverlaps
 
 
-//----------------------------------------------------------------------------
-//----------------------------------------------------------------------------
-
-
-typedef std::set<uint32_t> SegmentEdgeSet;
-
-//
-// Two of these are created for each DeepSegment to track
-// the active segments.
-//
-
-enum { THIN_EDGE = -1, FRONT_EDGE = 0, BACK_EDGE = 1 };
-
-struct SegmentEdge
-{
-    float      depth;
-    uint32_t   segment;
-    int        type;
-
-    SegmentEdge(float _depth, uint32_t _segment, int _type) :
-        depth(_depth),
-        segment(_segment),
-        type(_type)
-    {
-        //
-    }
-
-    bool operator < (const SegmentEdge& b) const
-    {
-        if (depth   < b.depth  ) return true;
-        if (depth   > b.depth  ) return false;
-        if (segment < b.segment) return true;
-        if (segment > b.segment) return false;
-        return (type < b.type);
-    }
-};
 
 
 //
@@ -905,12 +1391,14 @@ struct SegmentEdge
 void
 DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
                                const SpMask8& spmask,
-                               InterpolationMode interpolation)
+                               InterpolationMode interpolation,
+                               FlattenContext* ctx)
 {
     out.erase(out_channels);
     // Always fill in these output channels even though they may not be enabled
     // in the output pixel's channel set:
     //out[Chan_Z      ] =  INFINITYf;
+    out[Chan_A      ] =  0.0f;
     out[Chan_ZFront ] =  INFINITYf;
     out[Chan_ZBack  ] = -INFINITYf;
     out[Chan_CutoutA] =  0.0f;
@@ -954,8 +1442,14 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
         std::cout << "      useSpMasks=" << useSpMasks << ", interpolation=" << interpolation << std::endl;
 #endif
 
+    FlattenContext temp_ctx;
+    if (!ctx)
+        ctx = &temp_ctx;
+    FlattenContext::Scratch& scratch = ctx->scratch();
+
     // Build the list of SegmentEdges from DeepSegments:
-    std::vector<SegmentEdge> segment_edges;
+    std::vector<SegmentEdge>& segment_edges = scratch.segment_edges;
+    segment_edges.clear();
     segment_edges.reserve(nSegments * 2);
     for (uint32_t j=0; j < nSegments; ++j)
     {
@@ -997,21 +1491,25 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
     // Re-sort edges, this will change order based on edge type:
     std::sort(segment_edges.begin(), segment_edges.end());
 
-    SegmentEdgeSet active_segments;
+    SegmentEdgeSet& active_segments = scratch.active_segments;
+    active_segments.clear();
     int num_log_samples = 0;
     int num_lin_samples = 0;
     int num_additive_samples = 0;
 
-    std::vector<Pixelf> sample_colors;
-    sample_colors.reserve(10);
-    std::vector<Pixelf> prev_colors;
-    prev_colors.reserve(10);
+    std::vector<Pixelf>& sample_colors = scratch.sample_colors;
+    std::vector<Pixelf>& prev_colors = scratch.prev_colors;
 
-    Pixelf    black_color(comp_channels_with_cutout); black_color.erase();
-    Pixelf  section_color(comp_channels_with_cutout);
-    Pixelf   interp_color(comp_channels_with_cutout);
-    Pixelf   merged_color(comp_channels_with_cutout);
-    Pixelf additive_color(comp_channels_with_cutout);
+    Pixelf&    black_color = scratch.black_color;
+    Pixelf&  section_color = scratch.section_color;
+    Pixelf&   interp_color = scratch.interp_color;
+    Pixelf&   merged_color = scratch.merged_color;
+    Pixelf& additive_color = scratch.additive_color;
+    initScratchPixel(   black_color, comp_channels_with_cutout); black_color.erase();
+    initScratchPixel( section_color, comp_channels_with_cutout);
+    initScratchPixel(  interp_color, comp_channels_with_cutout);
+    initScratchPixel(  merged_color, comp_channels_with_cutout);
+    initScratchPixel(additive_color, comp_channels_with_cutout);
 
 #ifdef DCX_DEBUG_FLATTENER
     if (debug) {
@@ -1063,7 +1561,7 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
         if (edge.type == FRONT_EDGE)
         {
             // Add samples on their front edge:
-            active_segments.insert(edge.segment);
+            activateSegment(active_segments, edge.segment);
 #ifdef DCX_DEBUG_FLATTENER
             if (debug) std::cout << "           ** insert front-edge **" << std::endl;
 #endif
@@ -1074,7 +1572,7 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
         else if (edge.type == BACK_EDGE)
         {
             // Remove samples on their back edge:
-            active_segments.erase(edge.segment);
+            deactivateSegment(active_segments, edge.segment);
 #ifdef DCX_DEBUG_FLATTENER
             if (debug) std::cout << "           ** remove back-edge **" << std::endl;
 #endif
@@ -1622,10 +2120,8 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
                 // For now we're using a fixed number of steps:
                 const double step_size = (double(Z1) - double(Z0)) / double(SEGMENT_SAMPLE_STEPS - 1);
 
-                sample_colors.clear();
-                sample_colors.reserve(active_segments.size());
-                prev_colors.clear();
-                prev_colors.reserve(active_segments.size());
+                // The sample & prev color lists are reused by index:
+                size_t nSampleColors = 0;
 
                 // Initialize the sample colors to the start of the sub-segment:
                 for (SegmentEdgeSet::const_iterator it=active_segments.begin(); it != active_segments.end(); ++it)
@@ -1673,10 +2169,11 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
                            std::cout << " ]" << std::endl;
                         }
 #endif
-                        sample_colors.push_back(section_color);
+                        setScratchPixel(sample_colors, nSampleColors, section_color);
                         // And the first interpolated color at Zf:
                         const float t = (Z0 - interp_segment.Zf) / segment_thickness;
-                        prev_colors.push_back(section_color * t);
+                        setScratchPixel(prev_colors, nSampleColors, section_color) *= t;
+                        ++nSampleColors;
 
                     }
                     else
@@ -1705,8 +2202,9 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
                            std::cout << " ]" << std::endl;
                         }
 #endif
-                        sample_colors.push_back(section_color);
-                        prev_colors.push_back(black_color);
+                        setScratchPixel(sample_colors, nSampleColors, section_color);
+                        setScratchPixel(prev_colors, nSampleColors, black_color);
+                        ++nSampleColors;
                     }
                 } // active segments loop
 #ifdef DCX_DEBUG_FLATTENER
@@ -1756,14 +2254,18 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
                             // Interpolate to Zt, and un-under Zt from previous:
                             const double Zt = double(Z0) + double(i)*step_size;
                             const float t = float((Zt - double(interp_segment.Zf)) / segment_thickness);
-                            interp_color = sample_colors[interp_index]*t;
+                            interp_color = sample_colors[interp_index];
+                            interp_color *= t;
                             Pixelf& prev_color  = prev_colors[interp_index];
                             const float Ba = prev_color[Chan_A];
                             // UN-UNDER:
-                            if (Ba <= 0.0f)
-                                section_color = (interp_color - prev_color);
-                            else if (Ba < 1.0f)
-                                section_color = (interp_color - prev_color) / (1.0f - Ba);
+                            if (Ba < 1.0f)
+                            {
+                                section_color = interp_color;
+                                section_color -= prev_color;
+                                if (Ba > 0.0f)
+                                    section_color /= (1.0f - Ba);
+                            }
                             else
                                 section_color = black_color;
 #ifdef DCX_DEBUG_FLATTENER
@@ -1809,7 +2311,9 @@ DeepPixel::flattenOverlapping (const ChannelSet& out_channels, Pixelf& out,
                         }
                         else
                         {
-                            merged_color += section_color * section_color[Chan_A];
+                            const float section_alpha = section_color[Chan_A];
+                            foreach_channel(z, section_color.channels)
+                                merged_color[z] += section_color[z]*section_alpha;
                             accum_alpha += section_color[Chan_A];
                             //merged_alpha = merged_alpha*(1.0f - section_color[Chan_A]) + section_color[Chan_A];
                         }
@@ -42,6 +42,7 @@
 //
 //  struct  DeepMetadata
 //  class   DeepSegment
+//  class   FlattenContext
 //  class   DeepPixel
 //
 //-----------------------------------------------------------------------------
@@ -351,6 +352,44 @@ class DCX_EXPORT DeepSegment
 
 
 
+//----------------------------------------------------------------------------------------
+//
+//  class FlattenContext
+//
+//      Scratch buffers used by the DeepPixel flatten methods - the segment edge list,
+//      active segment list, interpolation sample colors and per-subpixel accumulators.
+//
+//      Passing the same context to successive flatten calls lets these buffers be
+//      reused so flattening doesn't allocate once they've grown to fit the deepest
+//      pixel seen.  If no context is passed the flatten methods use a temporary one.
+//
+//      A context holds no results between calls, but it must only be used by one
+//      thread at a time - keep one per thread when flattening in parallel.
+//
+//----------------------------------------------------------------------------------------
+
+class DCX_EXPORT FlattenContext
+{
+  public:
+
+    FlattenContext ();
+    ~FlattenContext ();
+
+  private:
+    friend class DeepPixel;
+
+    struct Scratch;
+    Scratch*    m_scratch;      // Allocated on first use
+
+    Scratch& scratch ();
+
+    // Not copyable:
+    FlattenContext (const FlattenContext&);
+    FlattenContext& operator = (const FlattenContext&);
+};
+
+
+
 //----------------------------------------------------------------------------------------
 //
 //  class DeepPixel
@@ -364,6 +403,21 @@ class DCX_EXPORT DeepSegment
 //      Because a DeepSegment is lightweight the list can be rearranged and sorted very
 //      quickly.  The list of large Pixel channel data structures is kept static.
 //
+//      Sorting also copies the segment depths, masks and flags into packed arrays
+//      (structure-of-arrays) so the overlap and flattening scans can walk contiguous
+//      memory rather than striding through the DeepSegment list.  These arrays are
+//      only valid while the sorted flag is true - like the sort order itself, if
+//      segments are modified through the non-const accessors sort(true) must be
+//      called before flattening.
+//
+//      Channel values are not packed into per-channel arrays.  Callers (DeepTransform,
+//      the tile adapters, the Nuke adapter) hold Pixelf& references from getSegmentPixel()
+//      and write through them, so the Pixel list has to remain the primary storage.
+//      Packed copies would go stale on every such write, and re-copying every channel
+//      on each sort() costs more than the flatten loops would save.  For the same
+//      reason the arithmetic operators work on the Pixel list directly, which is
+//      already contiguous and needs no segment indirection.
+//
 //      TODO: add methods for removing DeepSegments and their Pixels.
 //      TODO: investigate cost of using varying-sized Pixels
 //      TODO: add methods to get interpolated value at specific depths
@@ -382,6 +436,8 @@ class DCX_EXPORT DeepPixel
     DeepPixel (const ChannelIdx z);
     DeepPixel (const DeepPixel& b);
 
+    DeepPixel& operator = (const DeepPixel& b);
+
     //---------------------------------------------------------
     // Read-only ChannelSet access
     //      This ChannelSet is shared between all DeepSegments.
@@ -527,6 +583,11 @@ class DCX_EXPORT DeepPixel
     // is the weighted accumulation of all subpixel results.
     // If the subpixel mask for all segments are full-coverage then only
     // one flatten operation is performed.
+    // Subpixels that see the same set of segments always produce the
+    // same result so they're grouped and each group is flattened once.
+    // Groups without overlapping segments are composited together in a
+    // single front-to-back pass, only the overlapping ones are flattened
+    // individually.
     //
     // 'interpolation' determines the per-segment interpolation
     // behavior - default is INTERP_AUTO.
@@ -538,11 +599,15 @@ class DCX_EXPORT DeepPixel
     // order. Each segment is composited with the previous using an
     // UNDER or PLUS operation depending on whether the segment is
     // flagged as additive.
+    //
+    // 'ctx' optionally supplies reusable scratch buffers, see
+    // FlattenContext.
     //------------------------------------------------------------------
 
     void    flatten (const ChannelSet& out_channels,
                      Pixelf& out,
-                     InterpolationMode interpolation = INTERP_AUTO);
+                     InterpolationMode interpolation = INTERP_AUTO,
+                     FlattenContext* ctx = 0);
 
 
     //-------------------------------------------------------------------
@@ -564,7 +629,8 @@ class DCX_EXPORT DeepPixel
     void    flattenSubpixels (const ChannelSet& out_channels,
                               Pixelf& out,
                               const SpMask8& spmask,
-                              InterpolationMode interpolation = INTERP_AUTO);
+                              InterpolationMode interpolation = INTERP_AUTO,
+                              FlattenContext* ctx = 0);
 
 
     //---------------------------------------------------------------
@@ -597,7 +663,8 @@ class DCX_EXPORT DeepPixel
     void    flattenOverlapping (const ChannelSet& out_channels,
                                 Pixelf& out,
                                 const SpMask8& spmask,
-                                InterpolationMode interpolation = INTERP_AUTO);
+                                InterpolationMode interpolation = INTERP_AUTO,
+                                FlattenContext* ctx = 0);
 
 
     //-------------------------------------------------------
@@ -629,6 +696,12 @@ class DCX_EXPORT DeepPixel
     //
     bool                        m_sorted;           // Have the segments been Z-sorted?
     bool                        m_overlaps;         // Are there any Z overlaps between segments?
+    SpMask8                     m_overlap_mask;     // Subpixel bins that have Z overlaps between their segments
+    //
+    std::vector<float>          m_sorted_Zf;        // Packed segment Zf's in sorted order (built by sort())
+    std::vector<float>          m_sorted_Zb;        // Packed segment Zb's in sorted order
+    std::vector<SpMask8>        m_sorted_spmasks;   // Packed segment spmasks in sorted order
+    std::vector<DeepFlag>       m_sorted_flags;     // Packed segment flags in sorted order
     //
     SpMask8                     m_accum_or_mask;    // Subpixel bits that are on for ANY segment
     SpMask8                     m_accum_and_mask;   // Subpixel bits that are on for ALL segments
@@ -720,6 +793,7 @@ inline DeepPixel::DeepPixel (const ChannelSet& channels) :
     m_channels(channels),
     m_sorted(false),
     m_overlaps(false),
+    m_overlap_mask(SpMask8::zeroCoverage),
     m_accum_or_mask(SpMask8::zeroCoverage),
     m_accum_and_mask(SpMask8::zeroCoverage),
     m_accum_or_flags(DEEP_EMPTY_FLAG),
@@ -729,21 +803,29 @@ inline DeepPixel::DeepPixel (const ChannelIdx channel) :
     m_channels(channel),
     m_sorted(false),
     m_overlaps(false),
+    m_overlap_mask(SpMask8::zeroCoverage),
     m_accum_or_mask(SpMask8::zeroCoverage),
     m_accum_and_mask(SpMask8::zeroCoverage),
     m_accum_or_flags(DEEP_EMPTY_FLAG),
     m_accum_and_flags(DEEP_EMPTY_FLAG)
 {}
-inline DeepPixel::DeepPixel (const DeepPixel& b) {
+inline DeepPixel::DeepPixel (const DeepPixel& b) { *this = b; }
+inline DeepPixel& DeepPixel::operator = (const DeepPixel& b) {
     m_channels        = b.m_channels;
     m_segments        = b.m_segments;
     m_pixels          = b.m_pixels;
     m_sorted          = b.m_sorted;
     m_overlaps        = b.m_overlaps;
+    m_overlap_mask    = b.m_overlap_mask;
+    m_sorted_Zf       = b.m_sorted_Zf;
+    m_sorted_Zb       = b.m_sorted_Zb;
+    m_sorted_spmasks  = b.m_sorted_spmasks;
+    m_sorted_flags    = b.m_sorted_flags;
     m_accum_or_mask   = b.m_accum_or_mask;
     m_accum_and_mask  = b.m_accum_and_mask;
     m_accum_or_flags  = b.m_accum_or_flags;
     m_accum_and_flags = b.m_accum_and_flags;
+    return *this;
 }
 //
 inline const ChannelSet& DeepPixel::channels () const { return m_channels; }
@@ -792,28 +874,31 @@ inline void DeepPixel::flattenOverlappingLegacy (const ChannelSet& out_channels,
 }
 //
 inline DeepPixel& DeepPixel::operator += (float val) {
-    const size_t nSegments = m_segments.size();
-    for (size_t i=0; i < nSegments; ++i)
-        getSegmentPixel(i) += val;
+    // Every segment has its own Pixel so skip the segment indirection:
+    const size_t nPixels = m_pixels.size();
+    for (size_t i=0; i < nPixels; ++i)
+        m_pixels[i] += val;
     return *this;
 }
 inline DeepPixel& DeepPixel::operator -= (float val) {
-    const size_t nSegments = m_segments.size();
-    for (size_t i=0; i < nSegments; ++i)
-        getSegmentPixel(i) -= val;
+    // Every segment has its own Pixel so skip the segment indirection:
+    const size_t nPixels = m_pixels.size();
+    for (size_t i=0; i < nPixels; ++i)
+        m_pixels[i] -= val;
     return *this;
 }
 inline DeepPixel& DeepPixel::operator *= (float val) {
-    const size_t nSegments = m_segments.size();
-    for (size_t i=0; i < nSegments; ++i)
-        getSegmentPixel(i) *= val;
+    // Every segment has its own Pixel so skip the segment indirection:
+    const size_t nPixels = m_pixels.size();
+    for (size_t i=0; i < nPixels; ++i)
+        m_pixels[i] *= val;
     return *this;
 }
 inline DeepPixel& DeepPixel::operator /= (float val) {
     const float ival = 1.0f / val;
-    const size_t nSegments = m_segments.size();
-    for (size_t i=0; i < nSegments; ++i)
-        getSegmentPixel(i) *= ival;
+    const size_t nPixels = m_pixels.size();
+    for (size_t i=0; i < nPixels; ++i)
+        m_pixels[i] *= ival;
     return *this;
 }
 //--------------------------------------------------------
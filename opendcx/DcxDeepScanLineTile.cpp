@@ -0,0 +1,276 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016 DreamWorks Animation LLC. 
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// *       Redistributions of source code must retain the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer.
+// *       Redistributions in binary form must reproduce the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer in the documentation and/or other materials
+//         provided with the distribution.
+// *       Neither the name of DreamWorks Animation nor the names of its
+//         contributors may be used to endorse or promote products
+//         derived from this software without specific prior written
+//         permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+///
+/// @file DcxDeepScanLineTile.cpp
+
+
+#include "DcxDeepScanLineTile.h"
+#include "DcxChannelContext.h"
+
+#include <OpenEXR/ImfHeader.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
+
+
+//-------------------------------------------------------------------------
+
+
+DeepScanLineInputTile::LineChunk::LineChunk () :
+    y0(0),
+    y1(-1)
+{
+    //
+}
+
+
+DeepScanLineInputTile::DeepScanLineInputTile (Imf::DeepScanLineInputFile& file,
+                                              ChannelContext& channel_ctx,
+                                              bool tileYup,
+                                              int window_lines,
+                                              const ChannelSet& read_channels) :
+    DeepTile(channel_ctx, WRITE_DISABLED, tileYup),
+    m_file(&file)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+
+    const Imf::Header& header = file.header();
+    m_display_window   = header.displayWindow();
+    m_file_data_window = header.dataWindow();
+    m_data_window      = m_file_data_window;
+    if (m_tile_yUp)
+    {
+        // Flip data window vertically:
+        m_data_window.max.y = m_display_window.max.y - m_file_data_window.min.y;
+        m_data_window.min.y = m_display_window.max.y - m_file_data_window.max.y;
+    }
+
+    // ZIP compresses 16 scanlines together, the other deep compressions one:
+    m_chunk_lines = (header.compression() == Imf::ZIP_COMPRESSION)?16:1;
+    if (window_lines <= 0)
+        window_lines = std::max(2*m_chunk_lines, 16);
+    m_chunks.resize(std::max(1, (window_lines + m_chunk_lines - 1) / m_chunk_lines));
+
+    // Find the file channels to read:
+    std::vector<std::string> names;
+    for (Imf::ChannelList::ConstIterator it=header.channels().begin(); it != header.channels().end(); ++it)
+        names.push_back(it.name());
+    std::vector<int> channel_map;
+    mapFileChannels(names, read_channels, channel_map);
+
+    // Only read the file channels the tile accepted:
+    m_chan_index.resize(channel_map.size(), -1);
+    for (size_t z=0; z < channel_map.size(); ++z)
+    {
+        if (channel_map[z] < 0)
+            continue;
+        m_chan_index[z] = int(m_file_channels.size());
+        m_file_channels.push_back(names[channel_map[z]]);
+    }
+}
+
+
+/*virtual*/
+DeepScanLineInputTile::~DeepScanLineInputTile ()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+
+void
+DeepScanLineInputTile::clear ()
+{
+    ScopedMutexLock lock(&m_mutex);
+    const size_t nChunks = m_chunks.size();
+    for (size_t i=0; i < nChunks; ++i)
+        m_chunks[i] = LineChunk();
+}
+
+
+const DeepScanLineInputTile::LineChunk&
+DeepScanLineInputTile::loadChunk (int file_y) const
+{
+    // Chunks are aligned to the top of the data window:
+    const int chunk_index = (file_y - m_file_data_window.min.y) / m_chunk_lines;
+    LineChunk& chunk = m_chunks[chunk_index % m_chunks.size()];
+    const int y0 = m_file_data_window.min.y + chunk_index*m_chunk_lines;
+    if (chunk.y0 == y0 && chunk.y1 >= chunk.y0)
+        return chunk;
+
+    const int y1 = std::min(y0 + m_chunk_lines - 1, m_file_data_window.max.y);
+    const int width = m_file_data_window.max.x - m_file_data_window.min.x + 1;
+    const size_t nPixels = size_t(width)*size_t(y1 - y0 + 1);
+
+    // Leave the chunk empty if the read throws:
+    chunk.y1 = chunk.y0 - 1;
+
+    // Slice bases are offset so the data window's first pixel in line y0
+    // lands on element 0:
+    const ptrdiff_t base_offset = ptrdiff_t(y0)*width + m_file_data_window.min.x;
+
+    chunk.sample_counts.resize(nPixels);
+    const Imf::Slice counts_slice(Imf::UINT,
+                                  (char*)(&chunk.sample_counts[0] - base_offset),
+                                  sizeof(uint32_t)/*xStride*/,
+                                  sizeof(uint32_t)*width/*yStride*/);
+    {
+        Imf::DeepFrameBuffer fb;
+        fb.insertSampleCountSlice(counts_slice);
+        m_file->setFrameBuffer(fb);
+        m_file->readPixelSampleCounts(y0, y1);
+    }
+
+    chunk.sample_offsets.resize(nPixels+1);
+    size_t nSamples = 0;
+    for (size_t i=0; i < nPixels; ++i)
+    {
+        chunk.sample_offsets[i] = nSamples;
+        nSamples += chunk.sample_counts[i];
+    }
+    chunk.sample_offsets[nPixels] = nSamples;
+
+    // Read every channel as float, with each pixel's sample pointer aimed
+    // at its spot in the packed array:
+    const size_t nChannels = m_file_channels.size();
+    chunk.samples.resize(nChannels);
+    std::vector<std::vector<float*> > ptrs(nChannels);
+    Imf::DeepFrameBuffer fb;
+    fb.insertSampleCountSlice(counts_slice);
+    for (size_t c=0; c < nChannels; ++c)
+    {
+        std::vector<float>& samples = chunk.samples[c];
+        samples.resize(std::max(nSamples, size_t(1))); // always point to valid data, even for 0 samples...
+        std::vector<float*>& chan_ptrs = ptrs[c];
+        chan_ptrs.resize(nPixels);
+        for (size_t i=0; i < nPixels; ++i)
+            chan_ptrs[i] = &samples[0] + chunk.sample_offsets[i];
+        fb.insert(m_file_channels[c], Imf::DeepSlice(Imf::FLOAT,
+                                                     (char*)(&chan_ptrs[0] - base_offset),
+                                                     sizeof(float*)/*xStride*/,
+                                                     sizeof(float*)*width/*yStride*/,
+                                                     sizeof(float)/*sampleStride*/));
+    }
+    m_file->setFrameBuffer(fb);
+    m_file->readPixels(y0, y1);
+
+    chunk.y0 = y0;
+    chunk.y1 = y1;
+    return chunk;
+}
+
+
+/*virtual*/
+size_t
+DeepScanLineInputTile::getNumSamplesAt (int x, int y) const
+{
+    if (!isActivePixel(x, y))
+        return 0;
+    const int file_y = fileY(y);
+    ScopedMutexLock lock(&m_mutex);
+    const LineChunk& chunk = loadChunk(file_y);
+    return chunk.sample_counts[pixelIndex(chunk, x, file_y)];
+}
+
+
+/*virtual*/
+bool
+DeepScanLineInputTile::getDeepPixel (int x,
+                                     int y,
+                                     Dcx::DeepPixel& pixel) const
+{
+    pixel.clear();
+    if (!isActivePixel(x, y))
+        return false;
+
+    if (m_channels.empty())
+        return true;
+
+    const int file_y = fileY(y);
+    ScopedMutexLock lock(&m_mutex);
+    const LineChunk& chunk = loadChunk(file_y);
+    const size_t index = pixelIndex(chunk, x, file_y);
+    const size_t nSamples = chunk.sample_counts[index];
+    if (nSamples == 0)
+        return true;
+
+    // Convert straight out of the chunk's packed arrays:
+    ScratchArray<const float*, 64> values_scratch;
+    const float** channel_values = values_scratch.get(m_channels.size());
+    getChannelValues(chunk, chunk.sample_offsets[index], channel_values);
+    packedSamplesToDeepPixel(channel_values, nSamples, pixel);
+
+    return true;
+}
+
+
+/*virtual*/
+bool
+DeepScanLineInputTile::getSampleMetadata (int x,
+                                          int y,
+                                          size_t sample,
+                                          Dcx::DeepMetadata& metadata) const
+{
+    if (!isActivePixel(x, y))
+        return false;
+    const int file_y = fileY(y);
+    ScopedMutexLock lock(&m_mutex);
+    const LineChunk& chunk = loadChunk(file_y);
+    const size_t index = pixelIndex(chunk, x, file_y);
+    if (sample >= chunk.sample_counts[index])
+        return false;
+    ScratchArray<const float*, 64> values_scratch;
+    const float** channel_values = values_scratch.get(m_channels.size());
+    getChannelValues(chunk, chunk.sample_offsets[index], channel_values);
+    packedSampleMetadata(channel_values, sample, metadata);
+    return true;
+}
+
+
+void
+DeepScanLineInputTile::getChannelValues (const LineChunk& chunk,
+                                         size_t sample_offset,
+                                         const float** channel_values) const
+{
+    size_t i = 0;
+    foreach_channel(z, m_channels)
+    {
+        const int c = (*z < m_chan_index.size())?m_chan_index[*z]:-1;
+        channel_values[i++] = (c < 0)?NULL:(&chunk.samples[c][0] + sample_offset);
+    }
+}
+
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
@@ -0,0 +1,224 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016 DreamWorks Animation LLC. 
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// *       Redistributions of source code must retain the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer.
+// *       Redistributions in binary form must reproduce the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer in the documentation and/or other materials
+//         provided with the distribution.
+// *       Neither the name of DreamWorks Animation nor the names of its
+//         contributors may be used to endorse or promote products
+//         derived from this software without specific prior written
+//         permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+///
+/// @file DcxDeepScanLineTile.h
+
+#ifndef INCLUDED_DCX_DEEPSCANLINETILE_H
+#define INCLUDED_DCX_DEEPSCANLINETILE_H
+
+//-----------------------------------------------------------------------------
+//
+//  class  DeepScanLineInputTile
+//
+//-----------------------------------------------------------------------------
+
+#include "DcxDeepTile.h"
+
+#ifdef __ICC
+// disable icc remark #1572: 'floating-point equality and inequality comparisons are unreliable'
+//   this is coming from OpenEXR/half.h...
+#  pragma warning(disable:2557)
+#endif
+#include <OpenEXR/ImfDeepScanLineInputFile.h>
+
+#include <pthread.h>
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
+
+//-----------------------------------------------------------------------------
+//
+// class DeepScanLineInputTile
+//
+//      Adapter class for an input deep scanline file that's read on demand,
+//      rather than loaded into a DeepImage first like DeepImageInputTile.
+//
+//      Decoded scanlines are kept in a sliding window of windowLines() lines
+//      so memory use is bounded by the window height rather than the image
+//      size. Lines are read a compression chunk at a time (16 lines for ZIP,
+//      otherwise 1) and their samples converted to float as they're read.
+//
+//      Reads are fastest when they move through the image in line order
+//      with no more overlap than the window holds, ex. a flatten or merge
+//      going line by line, or a transform without much rotation. Reads are
+//      serialized by an internal mutex so getDeepPixel() may be called from
+//      several threads, but threads reading rows further apart than the
+//      window will keep evicting each other's lines.
+//
+//-----------------------------------------------------------------------------
+
+class DCX_EXPORT DeepScanLineInputTile : public DeepTile
+{
+  public:
+
+    //
+    // Reads from 'file', which must stay open for the life of the tile.
+    // The display and data windows are copied from the file's header.
+    // A 'window_lines' of 0 keeps two compression chunks or 16 lines,
+    // whichever is more.
+    // If 'read_channels' is not empty only those channels (plus the depth
+    // and deep metadata channels) are read from the file.
+    //
+
+    DeepScanLineInputTile (OPENEXR_IMF_NAMESPACE::DeepScanLineInputFile& file,
+                           ChannelContext& channel_ctx,
+                           bool tileYup=true,
+                           int window_lines=0,
+                           const ChannelSet& read_channels=Mask_None);
+
+    /*virtual*/ ~DeepScanLineInputTile ();
+
+
+    //
+    // The file being read.
+    //
+
+    OPENEXR_IMF_NAMESPACE::DeepScanLineInputFile& file () const;
+
+
+    //
+    // Number of scanlines kept decoded.
+    //
+
+    int     windowLines () const;
+
+
+    //
+    // Release all the decoded scanlines.
+    //
+
+    void    clear ();
+
+
+    //
+    // Returns the number of deep samples at pixel x,y.
+    //
+
+    /*virtual*/ size_t getNumSamplesAt (int x, int y) const;
+
+
+    //
+    // Reads deep samples from a pixel-space location (x, y) into a deep pixel,
+    // decoding the scanline first if it's not in the window.
+    // If xy is out of bounds the deep pixel is left empty and false is returned.
+    //
+
+    /*virtual*/ bool getDeepPixel (int x,
+                                   int y,
+                                   Dcx::DeepPixel& pixel) const;
+
+    /*virtual*/ bool getSampleMetadata (int x,
+                                        int y,
+                                        size_t sample,
+                                        Dcx::DeepMetadata& metadata) const;
+
+
+  protected:
+
+    //
+    // A compression chunk's worth of decoded scanlines.
+    //
+
+    struct LineChunk
+    {
+        int                                 y0, y1;         // File scanlines held, y1 < y0 if none
+        std::vector<uint32_t>               sample_counts;  // Per-pixel sample count
+        std::vector<size_t>                 sample_offsets; // Per-pixel offset of first sample, plus the total
+        std::vector<std::vector<float> >    samples;        // Packed samples for each of m_file_channels
+
+        LineChunk ();
+    };
+
+    //
+    // Returns the chunk holding file scanline 'file_y', reading it from the
+    // file if it's not in the window. m_mutex must be locked.
+    //
+
+    const LineChunk& loadChunk (int file_y) const;
+
+    //
+    // Offset of pixel x, file scanline 'file_y', in the chunk's per-pixel arrays.
+    //
+
+    size_t  pixelIndex (const LineChunk& chunk,
+                        int x,
+                        int file_y) const;
+
+    //
+    // Point 'channel_values' at each of m_channels' packed samples in the
+    // chunk, starting at 'sample_offset', NULL if the file doesn't have it.
+    //
+
+    void    getChannelValues (const LineChunk& chunk,
+                              size_t sample_offset,
+                              const float** channel_values) const;
+
+    int     fileY (int y) const;
+
+
+  protected:
+
+    OPENEXR_IMF_NAMESPACE::DeepScanLineInputFile* m_file;   // File being read
+    IMATH_NAMESPACE::Box2i          m_file_data_window;     // Data window in file (Y-down) coordinates
+    std::vector<std::string>        m_file_channels;        // Names of the file channels read
+    std::vector<int>                m_chan_index;           // Per-ChannelIdx index into m_file_channels, -1 if none
+    int                             m_chunk_lines;          // Scanlines per compression chunk
+    mutable std::vector<LineChunk>  m_chunks;               // Window of chunks, chunk n in slot n % size
+    mutable pthread_mutex_t         m_mutex;                // Guards m_chunks and the file
+
+};
+
+
+
+//-----------------
+// Inline Functions
+//-----------------
+
+inline
+OPENEXR_IMF_NAMESPACE::DeepScanLineInputFile& DeepScanLineInputTile::file () const { return *m_file; }
+inline
+int DeepScanLineInputTile::windowLines () const { return int(m_chunks.size())*m_chunk_lines; }
+inline
+int DeepScanLineInputTile::fileY (int y) const { return (m_tile_yUp)?(m_display_window.max.y - y):y; }
+inline
+size_t DeepScanLineInputTile::pixelIndex (const LineChunk& chunk,
+                                          int x,
+                                          int file_y) const {
+    return size_t(file_y - chunk.y0)*size_t(m_file_data_window.max.x - m_file_data_window.min.x + 1) +
+           size_t(x - m_file_data_window.min.x); }
+
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
+
+#endif // INCLUDED_DCX_DEEPSCANLINETILE_H
@@ -37,6 +37,11 @@
 
 
 #include "DcxDeepTile.h"
+#include "DcxChannelContext.h"
+
+#include <pthread.h>
+#include <unistd.h> // for sysconf
+#include <algorithm>
 
 
 OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
@@ -130,4 +135,465 @@ DeepTile::~DeepTile ()
 }
 
 
+void
+DeepTile::mapFileChannels (const std::vector<std::string>& names,
+                           const ChannelSet& read_channels,
+                           std::vector<int>& channel_map)
+{
+    const size_t nNames = names.size();
+    std::vector<ChannelAlias*> aliases(nNames, (ChannelAlias*)NULL);
+    Dcx::ChannelAliasPtrSet tile_channels; // set of channels to initialize tile to
+    for (size_t i=0; i < nNames; ++i)
+    {
+        ChannelAlias* c = m_channel_ctx->getChannelAlias(names[i]);
+        if (!c || c->channel() == Dcx::Chan_Invalid)
+            continue; // error creating the alias!  TODO: throw exception?
+        if (!isReadChannel(c->channel(), read_channels))
+            continue; // not requested
+        aliases[i] = c;
+        tile_channels.insert(c);
+    }
+
+    // Update the active channel set:
+    DeepTile::updateChannels(tile_channels);
+
+    // Read each channel from the first file channel with the alias the
+    // tile accepted:
+    channel_map.clear();
+    channel_map.resize(m_channel_ctx->lastAssignedChannel()+1, -1);
+    for (size_t i=0; i < nNames; ++i)
+    {
+        if (!aliases[i])
+            continue;
+        const ChannelIdx z = aliases[i]->channel();
+        if (getChannelAlias(z) != aliases[i] || channel_map[z] >= 0)
+            continue;
+        channel_map[z] = int(i);
+    }
+}
+
+
+//
+// Find the depth and deep metadata channels' arrays in a packed
+// channel_values list, NULL if the tile doesn't have them:
+//
+
+static inline void
+findDeepValues (const ChannelSet& channels,
+                ChannelIdx flags_channel,
+                const float* const* channel_values,
+                const float*& Zf,
+                const float*& Zb,
+                const float*& sp1,
+                const float*& sp2,
+                const float*& flags)
+{
+    Zf = Zb = sp1 = sp2 = flags = NULL;
+    size_t i = 0;
+    foreach_channel(z, channels)
+    {
+        const float* values = channel_values[i++];
+        if (*z == Dcx::Chan_ZFront)
+            Zf = values;
+        else if (*z == Dcx::Chan_ZBack)
+            Zb = values;
+        else if (*z == Dcx::Chan_SpBits1)
+            sp1 = values;
+        else if (*z == Dcx::Chan_SpBits2)
+            sp2 = values;
+        if (*z == flags_channel)
+            flags = values;
+    }
+}
+
+static inline float
+packedValue (const float* values,
+             size_t sample)
+{
+    return (values)?values[sample]:0.0f;
+}
+
+static inline void
+sampleMetadata (size_t num_spmask_chans,
+                bool have_flags,
+                float sp1,
+                float sp2,
+                float flags,
+                Dcx::DeepMetadata& metadata)
+{
+    if (num_spmask_chans == 2)
+        metadata.spmask.fromFloat(sp1, sp2);
+    else if (num_spmask_chans != 1) // TODO: 4x4 legacy masks from one channel, left as-is for now
+        metadata.spmask = Dcx::SpMask8::zeroCoverage; // default to zero coverage (legacy data)
+
+    // Extract flags from flags channel (convert from floating-point integer value):
+    if (have_flags)
+        metadata.flags = (Dcx::DeepFlag)floorf(flags);
+    else
+        metadata.flags = Dcx::DEEP_EMPTY_FLAG;
+}
+
+static inline const float*
+zeroValues (ScratchArray<float, 256>& scratch,
+            size_t nSamples)
+{
+    float* zeros = scratch.get(nSamples);
+    std::fill(zeros, zeros + nSamples, 0.0f);
+    return zeros;
+}
+
+
+void
+DeepTile::packedSamplesToDeepPixel (const float* const* channel_values,
+                                    size_t nSamples,
+                                    Dcx::DeepPixel& pixel) const
+{
+    Dcx::ChannelSet copy_channels(m_channels);
+    copy_channels -= Dcx::Mask_Deep;
+    copy_channels -= Dcx::Mask_DeepMetadata;
+    copy_channels -= Dcx::Mask_Z;
+    pixel.setChannels(copy_channels);
+    if (nSamples == 0)
+        return;
+    pixel.reserve(nSamples);
+
+    const float *Zf, *Zb, *sp1, *sp2, *flags;
+    findDeepValues(m_channels, m_flags_channel, channel_values, Zf, Zb, sp1, sp2, flags);
+    const bool have_Zb    = (m_channels.contains(Dcx::Chan_ZBack));
+    const bool have_flags = (m_flags_channel != Dcx::Chan_Invalid);
+
+    // Channels with no data read from a block of zeros, which keeps the
+    // NULL tests out of the per-sample loop:
+    ScratchArray<float, 256> zeros_scratch;
+    const float* zeros = NULL;
+    if (!Zf || !Zb || !sp1 || !sp2 || !flags)
+        zeros = zeroValues(zeros_scratch, nSamples);
+    if (!Zf) Zf = zeros;
+    if (!Zb) Zb = zeros;
+    if (!sp1) sp1 = zeros;
+    if (!sp2) sp2 = zeros;
+    if (!flags) flags = zeros;
+
+    // Arrays of the channels copied to the segment Pixels, in copy_channels order:
+    ScratchArray<const float*, 64> copy_scratch;
+    const float** copy_values = copy_scratch.get(copy_channels.size());
+    size_t nCopy = 0;
+    size_t i = 0;
+    foreach_channel(z, m_channels)
+    {
+        if (copy_channels.contains(*z))
+        {
+            if (!channel_values[i] && !zeros)
+                zeros = zeroValues(zeros_scratch, nSamples);
+            copy_values[nCopy++] = (channel_values[i])?channel_values[i]:zeros;
+        }
+        ++i;
+    }
+
+    Dcx::DeepSegment ds;
+    for (size_t sample=0; sample < nSamples; ++sample)
+    {
+        ds.Zf = ds.Zb = Zf[sample];
+        // Skip samples with negative, infinite or nan Zfront:
+        if (ds.Zf < 0.0f || isinf(ds.Zf) || isnan(ds.Zf))
+            continue;
+
+        if (have_Zb)
+        {
+            ds.Zb = Zb[sample];
+            // Clamp Zback to reasonable values - allow infinity:
+            if (isnan(ds.Zb) || ds.Zb < ds.Zf)
+                ds.Zb = ds.Zf;
+        }
+
+        ds.index = (int)sample;
+
+        // Extract metadata from input channels:
+        sampleMetadata(m_num_spmask_chans, have_flags, sp1[sample], sp2[sample], flags[sample], ds.metadata);
+
+        // Add segment and copy pixel data:
+        const size_t dsindex = pixel.append(ds);
+        Dcx::Pixelf& p = pixel.getSegmentPixel(dsindex);
+        size_t c = 0;
+        foreach_channel(z, copy_channels)
+            p[*z] = copy_values[c++][sample];
+    }
+}
+
+
+void
+DeepTile::packedSampleMetadata (const float* const* channel_values,
+                                size_t sample,
+                                Dcx::DeepMetadata& metadata) const
+{
+    const float *Zf, *Zb, *sp1, *sp2, *flags;
+    findDeepValues(m_channels, m_flags_channel, channel_values, Zf, Zb, sp1, sp2, flags);
+    sampleMetadata(m_num_spmask_chans, (m_flags_channel != Dcx::Chan_Invalid),
+                   packedValue(sp1, sample), packedValue(sp2, sample), packedValue(flags, sample),
+                   metadata);
+}
+
+
+//-------------------------------------------------------------------------------------
+
+
+DeepTileCache::Entry::Entry (const ChannelSet& channels) :
+    x(0),
+    y(0),
+    last_used(0),
+    found(false),
+    pixel(channels)
+{
+    //
+}
+
+
+DeepTileCache::DeepTileCache (const DeepTile& tile,
+                              size_t max_pixels) :
+    DeepTile(tile),
+    m_tile(&tile),
+    m_clock(0)
+{
+    m_write_access_mode = WRITE_DISABLED;
+    if (max_pixels == 0)
+        max_pixels = 4*size_t(std::max(tile.w(), 1));
+    // Round the number of sets up to a power of two so the set index is a mask:
+    m_num_sets = 1;
+    while (m_num_sets*numWays < max_pixels)
+        m_num_sets <<= 1;
+    m_entries.resize(m_num_sets*numWays, Entry(m_channels));
+}
+
+
+/*virtual*/
+DeepTileCache::~DeepTileCache ()
+{
+    //
+}
+
+
+void
+DeepTileCache::clear ()
+{
+    for (size_t i=0; i < m_entries.size(); ++i)
+        m_entries[i].last_used = 0;
+    m_clock = 0;
+}
+
+
+const DeepTileCache::Entry*
+DeepTileCache::find (int x, int y) const
+{
+    // Hash x,y to a set and look for it in there:
+    uint32_t h = uint32_t(x)*0x9e3779b1u ^ uint32_t(y)*0x85ebca77u;
+    h ^= (h >> 16);
+    Entry* set = &m_entries[(h & (m_num_sets - 1))*numWays];
+
+    if (++m_clock == 0)
+    {
+        // Clock wrapped, so the last-used values don't order anymore:
+        for (size_t i=0; i < m_entries.size(); ++i)
+            m_entries[i].last_used = 0;
+        m_clock = 1;
+    }
+
+    Entry* victim = set;
+    for (int i=0; i < numWays; ++i)
+    {
+        Entry& e = set[i];
+        if (e.last_used != 0 && e.x == x && e.y == y)
+        {
+            e.last_used = m_clock;
+            return &e;
+        }
+        if (e.last_used < victim->last_used)
+            victim = &e;
+    }
+
+    // Not there, read it into the least-recently-used entry:
+    victim->x = x;
+    victim->y = y;
+    victim->last_used = m_clock;
+    victim->found = m_tile->getDeepPixel(x, y, victim->pixel);
+    return victim;
+}
+
+
+/*virtual*/
+size_t
+DeepTileCache::getNumSamplesAt (int x, int y) const
+{
+    return find(x, y)->pixel.size();
+}
+
+
+/*virtual*/
+bool
+DeepTileCache::getDeepPixel (int x,
+                             int y,
+                             Dcx::DeepPixel& pixel) const
+{
+    const Entry* e = find(x, y);
+    pixel = e->pixel;
+    return e->found;
+}
+
+
+/*virtual*/
+bool
+DeepTileCache::getSampleMetadata (int x,
+                                  int y,
+                                  size_t sample,
+                                  Dcx::DeepMetadata& metadata) const
+{
+    const Entry* e = find(x, y);
+    if (!e->found || sample >= e->pixel.size())
+        return false;
+    metadata = e->pixel.getSegment(sample).metadata;
+    return true;
+}
+
+/*virtual*/
+const Dcx::DeepPixel*
+DeepTileCache::peekDeepPixel (int x,
+                              int y,
+                              Dcx::DeepPixel&) const
+{
+    return &find(x, y)->pixel;
+}
+
+
+//-------------------------------------------------------------------------------------
+
+
+//
+// Rows shared by the flattenTile() threads.  Each thread takes the next
+// unclaimed row until they're all gone, so busy rows don't stall a thread
+// holding a fixed band.
+//
+
+struct FlattenTileJob
+{
+    const DeepTile*         tile;
+    ChannelSet              flatten_channels;   // Output channels minus depth
+    std::vector<ChannelIdx> plane_channels;     // Output ChannelIdx for each plane
+    std::vector<ChannelIdx> plane_sources;      // Flattened ChannelIdx to copy to each plane
+    InterpolationMode       interpolation;
+    float**                 planes;
+    int                     y0;
+    int                     y1;
+    size_t                  row_stride;
+
+    pthread_mutex_t         mutex;
+    int                     next_row;
+
+    bool nextRow (int& y)
+    {
+        pthread_mutex_lock(&mutex);
+        y = next_row++;
+        pthread_mutex_unlock(&mutex);
+        return (y <= y1);
+    }
+};
+
+
+static void*
+flattenTileRows (void* data)
+{
+    FlattenTileJob& job = *static_cast<FlattenTileJob*>(data);
+    const DeepTile& tile = *job.tile;
+    const size_t nPlanes = job.plane_channels.size();
+    const int x0 = tile.x();
+    const int x1 = tile.r();
+
+    DeepPixel deep_pixel(tile.channels());
+    Pixelf flattened(job.flatten_channels);
+    FlattenContext ctx;
+
+    int y;
+    while (job.nextRow(y))
+    {
+        const size_t row = size_t(y - job.y0)*job.row_stride;
+        for (int x=x0; x <= x1; ++x)
+        {
+            const size_t offset = row + size_t(x - x0);
+            if (tile.getNumSamplesAt(x, y) == 0 ||
+                !tile.getDeepPixel(x, y, deep_pixel) ||
+                deep_pixel.empty())
+            {
+                // Nothing to flatten:
+                for (size_t c=0; c < nPlanes; ++c)
+                    job.planes[c][offset] = (Mask_Depth.contains(job.plane_channels[c]))?INFINITYf:0.0f;
+                continue;
+            }
+
+            deep_pixel.flatten(job.flatten_channels, flattened, job.interpolation, &ctx);
+            for (size_t c=0; c < nPlanes; ++c)
+                job.planes[c][offset] = flattened[job.plane_sources[c]];
+        }
+    }
+    return NULL;
+}
+
+
+bool
+flattenTile (const DeepTile& tile,
+             const ChannelSet& out_channels,
+             InterpolationMode interpolation,
+             float* planes[],
+             int y0,
+             int y1,
+             size_t row_stride,
+             int num_threads)
+{
+    if (!planes || y1 < y0 || out_channels.empty() || tile.w() <= 0)
+        return false;
+
+    FlattenTileJob job;
+    job.tile             = &tile;
+    job.flatten_channels = out_channels;
+    job.flatten_channels -= Mask_Depth; // depths are always filled in by flatten()
+    job.interpolation    = interpolation;
+    job.planes           = planes;
+    job.y0               = y0;
+    job.y1               = y1;
+    job.row_stride       = (row_stride > 0)?row_stride:size_t(tile.w());
+    job.next_row         = y0;
+    foreach_channel(z, out_channels)
+    {
+        if (!planes[job.plane_channels.size()])
+            return false;
+        job.plane_channels.push_back(*z);
+        job.plane_sources.push_back((*z == Chan_Z)?Chan_ZFront:*z);
+    }
+
+    const int nRows = (y1 - y0 + 1);
+    if (num_threads <= 0)
+        num_threads = int(sysconf(_SC_NPROCESSORS_ONLN));
+    if (num_threads > nRows)
+        num_threads = nRows;
+
+    pthread_mutex_init(&job.mutex, NULL);
+    if (num_threads <= 1)
+    {
+        flattenTileRows(&job);
+    }
+    else
+    {
+        // The calling thread does its share too:
+        std::vector<pthread_t> threads(num_threads - 1);
+        size_t nStarted = 0;
+        for (; nStarted < threads.size(); ++nStarted)
+            if (pthread_create(&threads[nStarted], NULL, flattenTileRows, &job) != 0)
+                break; // carry on with the threads we've got
+        flattenTileRows(&job);
+        for (size_t i=0; i < nStarted; ++i)
+            pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.mutex);
+
+    return true;
+}
+
+
 OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
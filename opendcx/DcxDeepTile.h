@@ -41,6 +41,10 @@
 //-----------------------------------------------------------------------------
 //
 //  class  DeepTile
+//  class  DeepTileCache
+//  class  ScratchArray
+//  struct ScopedMutexLock
+//  flattenTile()
 //
 //-----------------------------------------------------------------------------
 
@@ -49,6 +53,8 @@
 
 #include <OpenEXR/ImathBox.h>
 
+#include <pthread.h>
+
 //----------------------------------------------------------------------------------------------------
 // TODO: this seems missing from IlmBase...where to put this...?
 template <class T>
@@ -221,6 +227,17 @@ class DCX_EXPORT DeepTile
                                int y,
                                Dcx::DeepPixel& pixel) const=0;
 
+    //
+    // Returns the deep samples at pixel-space location (x, y). Tiles that keep
+    // decoded pixels (ex. DeepTileCache) return their own copy, otherwise
+    // 'pixel' is filled with getDeepPixel() and returned. The result is only
+    // valid until the next read from this tile.
+    //
+
+    virtual const Dcx::DeepPixel* peekDeepPixel (int x,
+                                                 int y,
+                                                 Dcx::DeepPixel& pixel) const;
+
     virtual bool getSampleMetadata (int x,
                                     int y,
                                     size_t sample,
@@ -266,6 +283,39 @@ class DCX_EXPORT DeepTile
     //
     virtual void updateChannels (const ChannelAliasPtrSet& channels);
 
+    //
+    // Returns true if an input tile limited to 'read_channels' should read
+    // channel z. Depth and deep metadata channels are always read, and an
+    // empty 'read_channels' reads every channel.
+    //
+    static bool isReadChannel (ChannelIdx z,
+                               const ChannelSet& read_channels);
+
+    //
+    // Set the active channels from a list of file channel names, keeping
+    // the ones isReadChannel() accepts.  'channel_map' gets an entry per
+    // ChannelIdx holding the index in 'names' of the file channel each
+    // active channel is read from, or -1.
+    //
+    void mapFileChannels (const std::vector<std::string>& names,
+                          const ChannelSet& read_channels,
+                          std::vector<int>& channel_map);
+
+    //
+    // Fill 'pixel' from one pixel's samples stored as packed floats.
+    // 'channel_values' points to the pixel's first sample for each of
+    // m_channels, in ChannelSet order, or is NULL for a channel with no
+    // data which reads as 0.  The input tiles all convert through these
+    // so the Zfront/Zback and metadata rules stay the same for each.
+    //
+    void packedSamplesToDeepPixel (const float* const* channel_values,
+                                   size_t nSamples,
+                                   Dcx::DeepPixel& pixel) const;
+
+    void packedSampleMetadata (const float* const* channel_values,
+                               size_t sample,
+                               Dcx::DeepMetadata& metadata) const;
+
     // Assigned vars:
     WriteAccessMode         m_write_access_mode;    // Supported spatial write-access mode
     bool                    m_tile_yUp;             // Is Y-axis of tile pointing up(industry-std) or down(exr-std)?
@@ -282,6 +332,172 @@ class DCX_EXPORT DeepTile
 };
 
 
+//-----------------------------------------------------------------------------
+//
+// class DeepTileCache
+//
+//      Read-only DeepTile that sits in front of another DeepTile, keeping
+//      the pixels it has read so neighbourhood operations (ex. the
+//      DeepTransform::sample() footprint) don't decode the same pixel again
+//      for each output pixel that covers it.
+//
+//      Up to maxPixels() pixels are kept, in small least-recently-used sets
+//      keyed by x,y. Cache entries keep their DeepPixel storage so once it's
+//      warm, reads don't allocate.
+//
+//      A cache isn't thread-safe - give each thread its own in front of the
+//      shared tile.
+//
+//-----------------------------------------------------------------------------
+
+class DCX_EXPORT DeepTileCache : public DeepTile
+{
+  public:
+
+    //
+    // 'max_pixels' of 0 sizes the cache to four rows of the tile.
+    //
+
+    DeepTileCache (const DeepTile& tile,
+                   size_t max_pixels=0);
+
+    /*virtual*/ ~DeepTileCache ();
+
+
+    //
+    // The tile being cached.
+    //
+
+    const DeepTile& tile () const;
+
+
+    //
+    // Maximum number of pixels kept.
+    //
+
+    size_t  maxPixels () const;
+
+
+    //
+    // Forget all the cached pixels, ex. if the source tile has changed.
+    //
+
+    void    clear ();
+
+
+    /*virtual*/ size_t getNumSamplesAt (int x, int y) const;
+
+    /*virtual*/ bool getDeepPixel (int x,
+                                   int y,
+                                   Dcx::DeepPixel& pixel) const;
+
+    /*virtual*/ bool getSampleMetadata (int x,
+                                        int y,
+                                        size_t sample,
+                                        Dcx::DeepMetadata& metadata) const;
+
+    /*virtual*/ const Dcx::DeepPixel* peekDeepPixel (int x,
+                                                     int y,
+                                                     Dcx::DeepPixel& pixel) const;
+
+  protected:
+
+    struct Entry
+    {
+        int         x, y;
+        uint32_t    last_used;  // Clock value when last read, 0 if unused
+        bool        found;      // Source tile's getDeepPixel() result
+        DeepPixel   pixel;
+
+        Entry (const ChannelSet& channels);
+    };
+
+    enum { numWays = 4 };   // Entries per set
+
+    const Entry* find (int x, int y) const;
+
+    const DeepTile*             m_tile;         // Tile being cached
+    size_t                      m_num_sets;     // Power of two
+    mutable std::vector<Entry>  m_entries;      // m_num_sets*numWays entries
+    mutable uint32_t            m_clock;        // Ticks on every read
+
+};
+
+
+//
+// Locks a pthread mutex for the life of the scope, so an exception thrown
+// while it's held (ex. by a file read) doesn't leave it locked.
+//
+
+struct ScopedMutexLock
+{
+    pthread_mutex_t* m_mutex;
+
+    ScopedMutexLock (pthread_mutex_t* mutex) : m_mutex(mutex) { pthread_mutex_lock(m_mutex); }
+    ~ScopedMutexLock () { pthread_mutex_unlock(m_mutex); }
+};
+
+
+//-----------------------------------------------------------------------------
+//
+// class ScratchArray
+//
+//      Per-call scratch space for the tile read paths: N elements on the
+//      stack, falling back to the heap for larger requests so the common
+//      case doesn't allocate.
+//
+//-----------------------------------------------------------------------------
+
+template <typename T, size_t N>
+class ScratchArray
+{
+  public:
+
+    //
+    // Returns room for 'n' elements, valid until the next get() call.
+    //
+
+    T*  get (size_t n);
+
+  private:
+
+    T               m_stack[N];
+    std::vector<T>  m_heap;
+
+};
+
+
+//
+// Flatten rows 'y0' through 'y1' (inclusive, in the tile's pixel-space) of a
+// DeepTile into planar float buffers.
+//
+// 'planes' holds one buffer per channel in 'out_channels', in ChannelSet
+// order. Each buffer covers the tile's data window width starting at x(),
+// with row y0 first and each following row 'row_stride' floats further
+// on (0 means w().)
+// Depth channels get the flattened front (Chan_Z, Chan_ZFront) and back
+// (Chan_ZBack) depths rather than being composited.
+// Pixels with no samples are written as 0, or INF for depth channels.
+//
+// Rows are shared out between 'num_threads' threads, each with its own
+// DeepPixel and FlattenContext. 0 means one thread per core, 1 flattens
+// on the calling thread. The tile is only read, so its getDeepPixel()
+// must be safe to call concurrently (DeepImageInputTile's is.)
+//
+// Returns false if there's nothing to flatten into.
+//
+
+DCX_EXPORT
+bool    flattenTile (const DeepTile& tile,
+                     const ChannelSet& out_channels,
+                     InterpolationMode interpolation,
+                     float* planes[],
+                     int y0,
+                     int y1,
+                     size_t row_stride=0,
+                     int num_threads=0);
+
+
 
 //-----------------
 // Inline Functions
@@ -299,6 +515,9 @@ inline const ChannelAlias* DeepTile::getChannelAlias(ChannelIdx z) const
         return NULL;
     return it->second;
 }
+/*static*/ inline bool DeepTile::isReadChannel (ChannelIdx z, const ChannelSet& read_channels) {
+    return (read_channels.empty() || read_channels.contains(z) || Mask_Depth.contains(z) ||
+            z == Chan_DeepFlags || (z >= Chan_SpBits1 && z <= Chan_SpBitsLast)); }
 inline DeepTile::WriteAccessMode DeepTile::writeAccessMode () const { return m_write_access_mode; }
 inline bool DeepTile::writable () const { return (m_write_access_mode > WRITE_DISABLED); }
 inline
@@ -311,6 +530,14 @@ inline int DeepTile::r () const { return m_data_window.max.x; }
 inline int DeepTile::t () const { return m_data_window.max.y; }
 inline int DeepTile::w () const { return (m_data_window.max.x - m_data_window.min.x + 1); }
 inline int DeepTile::h () const { return (m_data_window.max.y - m_data_window.min.y + 1); }
+//
+template <typename T, size_t N>
+inline T* ScratchArray<T, N>::get (size_t n) {
+    if (n <= N)
+        return m_stack;
+    m_heap.resize(n);
+    return &m_heap[0];
+}
 inline int DeepTile::fx () const { return m_display_window.min.x; }
 inline int DeepTile::fy () const { return m_display_window.min.y; }
 inline int DeepTile::fr () const { return m_display_window.max.x; }
@@ -325,6 +552,11 @@ inline
 bool DeepTile::setDeepPixel (int, int, const Dcx::DeepPixel&) { return false; }
 inline
 bool DeepTile::clearDeepPixel (int, int) { return false; }
+inline
+const Dcx::DeepPixel* DeepTile::peekDeepPixel (int x, int y, Dcx::DeepPixel& pixel) const { getDeepPixel(x, y, pixel); return &pixel; }
+//
+inline const DeepTile& DeepTileCache::tile () const { return *m_tile; }
+inline size_t DeepTileCache::maxPixels () const { return m_entries.size(); }
 
 
 OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
@@ -0,0 +1,569 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016 DreamWorks Animation LLC. 
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// *       Redistributions of source code must retain the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer.
+// *       Redistributions in binary form must reproduce the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer in the documentation and/or other materials
+//         provided with the distribution.
+// *       Neither the name of DreamWorks Animation nor the names of its
+//         contributors may be used to endorse or promote products
+//         derived from this software without specific prior written
+//         permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+///
+/// @file DcxDeepTiledTile.cpp
+
+
+#include "DcxDeepTiledTile.h"
+#include "DcxChannelContext.h"
+
+#include <OpenEXR/ImfHeader.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+#include <OpenEXR/ImfTileDescription.h>
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
+
+
+//-------------------------------------------------------------------------
+
+
+DeepTiledInputTile::FileTile::FileTile () :
+    index(-1),
+    last_use(0)
+{
+    //
+}
+
+
+DeepTiledInputTile::DeepTiledInputTile (Imf::DeepTiledInputFile& file,
+                                        ChannelContext& channel_ctx,
+                                        bool tileYup,
+                                        int cache_tiles,
+                                        const ChannelSet& read_channels) :
+    DeepTile(channel_ctx, WRITE_DISABLED, tileYup),
+    m_file(&file),
+    m_use_count(0)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+
+    const Imf::Header& header = file.header();
+    m_display_window   = header.displayWindow();
+    m_file_data_window = header.dataWindow();
+    m_data_window      = m_file_data_window;
+    if (m_tile_yUp)
+    {
+        // Flip data window vertically:
+        m_data_window.max.y = m_display_window.max.y - m_file_data_window.min.y;
+        m_data_window.min.y = m_display_window.max.y - m_file_data_window.max.y;
+    }
+
+    m_file_tile_width  = int(file.tileXSize());
+    m_file_tile_height = int(file.tileYSize());
+    m_num_x_tiles      = file.numXTiles(0);
+    m_num_y_tiles      = file.numYTiles(0);
+    if (cache_tiles <= 0)
+        cache_tiles = m_num_x_tiles + 1;
+    m_tiles.resize(std::max(1, cache_tiles));
+    m_tile_slots.resize(size_t(std::max(0, m_num_x_tiles))*size_t(std::max(0, m_num_y_tiles)), -1);
+
+    // Find the file channels to read:
+    std::vector<std::string> names;
+    for (Imf::ChannelList::ConstIterator it=header.channels().begin(); it != header.channels().end(); ++it)
+        names.push_back(it.name());
+    std::vector<int> channel_map;
+    mapFileChannels(names, read_channels, channel_map);
+
+    // Only read the file channels the tile accepted:
+    m_chan_index.resize(channel_map.size(), -1);
+    for (size_t z=0; z < channel_map.size(); ++z)
+    {
+        if (channel_map[z] < 0)
+            continue;
+        m_chan_index[z] = int(m_file_channels.size());
+        m_file_channels.push_back(names[channel_map[z]]);
+    }
+}
+
+
+/*virtual*/
+DeepTiledInputTile::~DeepTiledInputTile ()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+
+void
+DeepTiledInputTile::clear ()
+{
+    ScopedMutexLock lock(&m_mutex);
+    const size_t nTiles = m_tiles.size();
+    for (size_t i=0; i < nTiles; ++i)
+        m_tiles[i] = FileTile();
+    std::fill(m_tile_slots.begin(), m_tile_slots.end(), -1);
+}
+
+
+const DeepTiledInputTile::FileTile&
+DeepTiledInputTile::loadTile (int x,
+                              int file_y) const
+{
+    // File tiles are aligned to the data window origin:
+    const int dx = (x - m_file_data_window.min.x) / m_file_tile_width;
+    const int dy = (file_y - m_file_data_window.min.y) / m_file_tile_height;
+    const int index = dy*m_num_x_tiles + dx;
+    ++m_use_count;
+
+    int slot = m_tile_slots[index];
+    if (slot >= 0)
+    {
+        m_tiles[slot].last_use = m_use_count;
+        return m_tiles[slot];
+    }
+
+    // Take an empty slot, or evict the least recently used tile:
+    const int nSlots = int(m_tiles.size());
+    slot = 0;
+    for (int i=0; i < nSlots; ++i)
+    {
+        if (m_tiles[i].index < 0)
+        {
+            slot = i;
+            break;
+        }
+        if (m_tiles[i].last_use < m_tiles[slot].last_use)
+            slot = i;
+    }
+    FileTile& tile = m_tiles[slot];
+    if (tile.index >= 0)
+        m_tile_slots[tile.index] = -1;
+
+    // Leave the slot empty if the read throws:
+    tile.index = -1;
+
+    tile.window = m_file->dataWindowForTile(dx, dy, 0);
+    const int width = tile.window.max.x - tile.window.min.x + 1;
+    const size_t nPixels = size_t(width)*size_t(tile.window.max.y - tile.window.min.y + 1);
+
+    // Slices use tile coordinates so the tile's first pixel lands on element 0:
+    tile.sample_counts.resize(nPixels);
+    const Imf::Slice counts_slice(Imf::UINT,
+                                  (char*)&tile.sample_counts[0],
+                                  sizeof(uint32_t)/*xStride*/,
+                                  sizeof(uint32_t)*width/*yStride*/,
+                                  1, 1/*x/ySampling*/,
+                                  0.0/*fillValue*/,
+                                  true, true/*x/yTileCoords*/);
+    {
+        Imf::DeepFrameBuffer fb;
+        fb.insertSampleCountSlice(counts_slice);
+        m_file->setFrameBuffer(fb);
+        m_file->readPixelSampleCount(dx, dy, 0);
+    }
+
+    tile.sample_offsets.resize(nPixels+1);
+    size_t nSamples = 0;
+    for (size_t i=0; i < nPixels; ++i)
+    {
+        tile.sample_offsets[i] = nSamples;
+        nSamples += tile.sample_counts[i];
+    }
+    tile.sample_offsets[nPixels] = nSamples;
+
+    // Read every channel as float, with each pixel's sample pointer aimed
+    // at its spot in the packed array:
+    const size_t nChannels = m_file_channels.size();
+    tile.samples.resize(nChannels);
+    std::vector<std::vector<float*> > ptrs(nChannels);
+    Imf::DeepFrameBuffer fb;
+    fb.insertSampleCountSlice(counts_slice);
+    for (size_t c=0; c < nChannels; ++c)
+    {
+        std::vector<float>& samples = tile.samples[c];
+        samples.resize(std::max(nSamples, size_t(1))); // always point to valid data, even for 0 samples...
+        std::vector<float*>& chan_ptrs = ptrs[c];
+        chan_ptrs.resize(nPixels);
+        for (size_t i=0; i < nPixels; ++i)
+            chan_ptrs[i] = &samples[0] + tile.sample_offsets[i];
+        fb.insert(m_file_channels[c], Imf::DeepSlice(Imf::FLOAT,
+                                                     (char*)&chan_ptrs[0],
+                                                     sizeof(float*)/*xStride*/,
+                                                     sizeof(float*)*width/*yStride*/,
+                                                     sizeof(float)/*sampleStride*/,
+                                                     1, 1/*x/ySampling*/,
+                                                     0.0/*fillValue*/,
+                                                     true, true/*x/yTileCoords*/));
+    }
+    m_file->setFrameBuffer(fb);
+    m_file->readTile(dx, dy, 0);
+
+    tile.index = index;
+    tile.last_use = m_use_count;
+    m_tile_slots[index] = slot;
+    return tile;
+}
+
+
+/*virtual*/
+size_t
+DeepTiledInputTile::getNumSamplesAt (int x, int y) const
+{
+    if (!isActivePixel(x, y))
+        return 0;
+    const int file_y = fileY(y);
+    ScopedMutexLock lock(&m_mutex);
+    const FileTile& tile = loadTile(x, file_y);
+    return tile.sample_counts[pixelIndex(tile, x, file_y)];
+}
+
+
+/*virtual*/
+bool
+DeepTiledInputTile::getDeepPixel (int x,
+                                  int y,
+                                  Dcx::DeepPixel& pixel) const
+{
+    pixel.clear();
+    if (!isActivePixel(x, y))
+        return false;
+
+    if (m_channels.empty())
+        return true;
+
+    const int file_y = fileY(y);
+    ScopedMutexLock lock(&m_mutex);
+    const FileTile& tile = loadTile(x, file_y);
+    const size_t index = pixelIndex(tile, x, file_y);
+    const size_t nSamples = tile.sample_counts[index];
+    if (nSamples == 0)
+        return true;
+
+    // Convert straight out of the file tile's packed arrays:
+    ScratchArray<const float*, 64> values_scratch;
+    const float** channel_values = values_scratch.get(m_channels.size());
+    getChannelValues(tile, tile.sample_offsets[index], channel_values);
+    packedSamplesToDeepPixel(channel_values, nSamples, pixel);
+
+    return true;
+}
+
+
+/*virtual*/
+bool
+DeepTiledInputTile::getSampleMetadata (int x,
+                                       int y,
+                                       size_t sample,
+                                       Dcx::DeepMetadata& metadata) const
+{
+    if (!isActivePixel(x, y))
+        return false;
+    const int file_y = fileY(y);
+    ScopedMutexLock lock(&m_mutex);
+    const FileTile& tile = loadTile(x, file_y);
+    const size_t index = pixelIndex(tile, x, file_y);
+    if (sample >= tile.sample_counts[index])
+        return false;
+    ScratchArray<const float*, 64> values_scratch;
+    const float** channel_values = values_scratch.get(m_channels.size());
+    getChannelValues(tile, tile.sample_offsets[index], channel_values);
+    packedSampleMetadata(channel_values, sample, metadata);
+    return true;
+}
+
+
+void
+DeepTiledInputTile::getChannelValues (const FileTile& tile,
+                                      size_t sample_offset,
+                                      const float** channel_values) const
+{
+    size_t i = 0;
+    foreach_channel(z, m_channels)
+    {
+        const int c = (*z < m_chan_index.size())?m_chan_index[*z]:-1;
+        channel_values[i++] = (c < 0)?NULL:(&tile.samples[c][0] + sample_offset);
+    }
+}
+
+
+//-------------------------------------------------------------------------
+//-------------------------------------------------------------------------
+
+
+DeepTiledOutputTile::DeepTiledOutputTile (const IMATH_NAMESPACE::Box2i& display_window,
+                                          const IMATH_NAMESPACE::Box2i& data_window,
+                                          bool sourceWindowsYup,
+                                          const ChannelAliasPtrSet& channels,
+                                          ChannelContext& channel_ctx,
+                                          bool tileYup,
+                                          int file_tile_width,
+                                          int file_tile_height) :
+    DeepImageOutputTile(display_window, data_window, sourceWindowsYup, channels, channel_ctx, tileYup),
+    m_tiled_file(0),
+    m_file_tile_width(std::max(1, file_tile_width)),
+    m_file_tile_height(std::max(1, file_tile_height))
+{
+    //
+}
+
+
+DeepTiledOutputTile::DeepTiledOutputTile (const DeepTile& b,
+                                          int file_tile_width,
+                                          int file_tile_height) :
+    DeepImageOutputTile(b),
+    m_tiled_file(0),
+    m_file_tile_width(std::max(1, file_tile_width)),
+    m_file_tile_height(std::max(1, file_tile_height))
+{
+    //
+}
+
+
+/*virtual*/
+DeepTiledOutputTile::~DeepTiledOutputTile ()
+{
+    // Write any unfinished rows, but don't throw from a destructor:
+    try { writeTile(true); } catch (...) {}
+    delete m_tiled_file;
+}
+
+
+//
+// Create an output deep tiled file linked to this tile - destructive!
+// Will allocate a new Imf::DeepTiledOutputFile and assign its
+// channels, destroying any current file.
+//
+
+/*virtual*/
+void
+DeepTiledOutputTile::setOutputFile (const char* filename,
+                                    Imf::LineOrder line_order,
+                                    Imf::Compression compression,
+                                    const Imf::Header* attributes)
+{
+    if (!filename || !filename[0] || m_filename == filename)
+        return;
+    m_filename = filename;
+    writeTile(true); // finish the current file first
+
+    // File windows are Y-down:
+    m_file_data_window = m_data_window;
+    if (m_tile_yUp)
+    {
+        m_file_data_window.min.y = fileY(m_data_window.max.y);
+        m_file_data_window.max.y = fileY(m_data_window.min.y);
+    }
+
+    // Flip line order to match Y-up mode.  RANDOM_Y is left as-is, tiled
+    // files support it directly:
+    if (line_order == Imf::DECREASING_Y)
+        line_order = (m_tile_yUp)?Imf::INCREASING_Y:Imf::DECREASING_Y;
+    else if (line_order == Imf::INCREASING_Y)
+        line_order = (m_tile_yUp)?Imf::DECREASING_Y:Imf::INCREASING_Y;
+
+    Imf::Header header(m_display_window,
+                       m_file_data_window,
+                       1.0,/*pixelAspectRatio*/
+                       IMATH_NAMESPACE::V2f(0.0f, 0.0f), /*screenWindowCenter*/
+                       1.0f, /*screenWindowWidth*/
+                       line_order);
+    header.setTileDescription(Imf::TileDescription(m_file_tile_width, m_file_tile_height, Imf::ONE_LEVEL));
+    initOutputHeader(header, compression, attributes);
+
+    delete m_tiled_file;
+    m_tiled_file = new Imf::DeepTiledOutputFile(filename, header);
+    deleteDeepLines();
+    m_row_lines.clear();
+    m_row_lines.resize(m_tiled_file->numYTiles(0), 0);
+    m_line_finished.clear();
+    m_line_finished.resize(h(), false);
+}
+
+
+//
+// Write one file tile, unpacking its pixels from the DeepLines to arrays
+// of the file channel types.  'line_offsets' holds the float offset of
+// the tile's left edge in each of its DeepLines.
+//
+
+void
+DeepTiledOutputTile::writeFileTile (int dx,
+                                    int dy,
+                                    std::vector<uint32_t>& line_offsets)
+{
+    const IMATH_NAMESPACE::Box2i window = m_tiled_file->dataWindowForTile(dx, dy, 0);
+    const int width = window.max.x - window.min.x + 1;
+    const int height = window.max.y - window.min.y + 1;
+    const size_t nPixels = size_t(width)*size_t(height);
+    const int xoffset = window.min.x - m_data_window.min.x;
+
+    // Gather the sample counts and each pixel's first float in its DeepLine,
+    // advancing the row's per-line offsets past this tile:
+    std::vector<uint32_t> sample_counts(nPixels, 0);
+    std::vector<uint32_t> float_offsets(nPixels, 0);
+    std::vector<const DeepLine*> lines(height);
+    size_t nSamples = 0;
+    for (int j=0; j < height; ++j)
+    {
+        const DeepLine* dl = lines[j] = getLine(tileY(window.min.y + j));
+        if (!dl)
+            continue;
+        uint32_t& foffset = line_offsets[j];
+        for (int i=0; i < width; ++i)
+        {
+            const size_t p = size_t(j)*width + i;
+            sample_counts[p] = dl->samples_per_pixel[xoffset + i];
+            float_offsets[p] = foffset;
+            foffset += sample_counts[p];
+            nSamples += sample_counts[p];
+        }
+    }
+
+    Imf::DeepFrameBuffer fb;
+    fb.insertSampleCountSlice(Imf::Slice(Imf::UINT,
+                                         (char*)&sample_counts[0],
+                                         sizeof(uint32_t)/*xStride*/,
+                                         sizeof(uint32_t)*width/*yStride*/,
+                                         1, 1/*x/ySampling*/,
+                                         0.0/*fillValue*/,
+                                         true, true/*x/yTileCoords*/));
+
+    // Unpacked sample data storage, packed per channel in the file type:
+    const size_t nChannels = m_channels.size();
+    std::vector<std::vector<char> > channel_samples(nChannels);
+    std::vector<std::vector<char*> > data_ptrs(nChannels);
+
+    int chan_index = 0;
+    foreach_channel(z, m_channels)
+    {
+        const ChannelAlias* c = getChannelAlias(*z);
+#ifdef DEBUG
+        assert(c); // shouldn't happen...
+#endif
+        const Imf::PixelType type = m_file_types[chan_index];
+        const size_t sample_stride = (type == Imf::HALF)?sizeof(half):
+                                     (type == Imf::UINT)?sizeof(uint32_t):sizeof(float);
+
+        std::vector<char>& samples = channel_samples[chan_index];
+        samples.resize(std::max(nSamples, size_t(1))*sample_stride); // always point to valid data, even for 0 samples...
+        std::vector<char*>& ptrs = data_ptrs[chan_index];
+        ptrs.resize(nPixels);
+
+        char* OUT = &samples[0];
+        for (size_t p=0; p < nPixels; ++p)
+        {
+            ptrs[p] = OUT;
+            const size_t nPixelSamples = sample_counts[p];
+            if (nPixelSamples == 0)
+                continue;
+            const float* IN = lines[p / width]->channel_arrays[chan_index].data() + float_offsets[p];
+            for (size_t s=0; s < nPixelSamples; ++s, ++IN, OUT += sample_stride)
+            {
+                if (type == Imf::HALF)
+                    *(half*)OUT = half(*IN);
+                else if (type == Imf::UINT)
+                    *(uint32_t*)OUT = uint32_t(floorf((*IN < 0.0f)?0.0f:*IN));
+                else
+                    *(float*)OUT = *IN;
+            }
+        }
+
+        fb.insert(c->fileIOName(), Imf::DeepSlice(type,
+                                                  (char*)&ptrs[0],
+                                                  sizeof(char*)/*xStride*/,
+                                                  sizeof(char*)*width/*yStride*/,
+                                                  sample_stride/*sampleStride*/,
+                                                  1, 1/*x/ySampling*/,
+                                                  0.0/*fillValue*/,
+                                                  true, true/*x/yTileCoords*/));
+        ++chan_index;
+    }
+
+    m_tiled_file->setFrameBuffer(fb);
+    m_tiled_file->writeTile(dx, dy, 0);
+}
+
+
+void
+DeepTiledOutputTile::writeTileRow (int dy,
+                                   bool flush_lines)
+{
+    if (!m_tiled_file || dy < 0 || dy >= (int)m_row_lines.size() || m_row_lines[dy] < 0)
+        return; // don't crash...  TODO: throw exception?
+
+    const int y0 = m_file_data_window.min.y + dy*m_file_tile_height;
+    const int y1 = std::min(y0 + m_file_tile_height - 1, m_file_data_window.max.y);
+
+    // Write the tiles left to right so the DeepLine offsets only advance:
+    std::vector<uint32_t> line_offsets(y1 - y0 + 1, 0);
+    const int nXTiles = m_tiled_file->numXTiles(0);
+    for (int dx=0; dx < nXTiles; ++dx)
+        writeFileTile(dx, dy, line_offsets);
+    m_row_lines[dy] = -1;
+
+    // Free the row's DeepLines:
+    if (flush_lines)
+    {
+        for (int fy=y0; fy <= y1; ++fy)
+        {
+            const int line = tileY(fy) - m_data_window.min.y;
+            delete m_deep_lines[line];
+            m_deep_lines[line] = 0;
+        }
+    }
+}
+
+
+/*virtual*/
+void
+DeepTiledOutputTile::writeScanline (int y,
+                                    bool flush_line)
+{
+    if (!m_tiled_file || y < m_data_window.min.y || y > m_data_window.max.y)
+        return; // don't crash...  TODO: throw exception?
+
+    const int fy = fileY(y);
+    const int dy = (fy - m_file_data_window.min.y) / m_file_tile_height;
+    if (m_row_lines[dy] < 0 || m_line_finished[y - m_data_window.min.y])
+        return; // row already written, or line already counted
+    m_line_finished[y - m_data_window.min.y] = true;
+
+    const int y0 = m_file_data_window.min.y + dy*m_file_tile_height;
+    const int y1 = std::min(y0 + m_file_tile_height - 1, m_file_data_window.max.y);
+    if (++m_row_lines[dy] >= (y1 - y0 + 1))
+        writeTileRow(dy, flush_line);
+}
+
+
+/*virtual*/
+void
+DeepTiledOutputTile::writeTile (bool flush_tile)
+{
+    const int nRows = (int)m_row_lines.size();
+    for (int dy=0; dy < nRows; ++dy)
+        writeTileRow(dy, flush_tile);
+}
+
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
@@ -0,0 +1,358 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2016 DreamWorks Animation LLC. 
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// *       Redistributions of source code must retain the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer.
+// *       Redistributions in binary form must reproduce the above
+//         copyright notice, this list of conditions and the following
+//         disclaimer in the documentation and/or other materials
+//         provided with the distribution.
+// *       Neither the name of DreamWorks Animation nor the names of its
+//         contributors may be used to endorse or promote products
+//         derived from this software without specific prior written
+//         permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+///
+/// @file DcxDeepTiledTile.h
+
+#ifndef INCLUDED_DCX_DEEPTILEDTILE_H
+#define INCLUDED_DCX_DEEPTILEDTILE_H
+
+//-----------------------------------------------------------------------------
+//
+//  class  DeepTiledInputTile
+//  class  DeepTiledOutputTile
+//
+//-----------------------------------------------------------------------------
+
+#include "DcxDeepImageTile.h"
+
+#ifdef __ICC
+// disable icc remark #1572: 'floating-point equality and inequality comparisons are unreliable'
+//   this is coming from OpenEXR/half.h...
+#  pragma warning(disable:2557)
+#endif
+#include <OpenEXR/ImfDeepTiledInputFile.h>
+#include <OpenEXR/ImfDeepTiledOutputFile.h>
+
+#include <pthread.h>
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
+
+//-----------------------------------------------------------------------------
+//
+// class DeepTiledInputTile
+//
+//      Adapter class for an input deep tiled file that's read on demand.
+//
+//      Only the file tiles that getDeepPixel() etc. touch are decoded, so
+//      reading a region of interest (a crop, or the footprint of a
+//      DeepTransform) costs the tiles under it rather than the whole image.
+//      Decoded tiles are kept in an LRU cache of cacheSize() tiles and
+//      their samples converted to float as they're read.
+//
+//      Only level 0 of mipmapped or ripmapped files is read.  Reads are
+//      serialized by an internal mutex so getDeepPixel() may be called from
+//      several threads.
+//
+//-----------------------------------------------------------------------------
+
+class DCX_EXPORT DeepTiledInputTile : public DeepTile
+{
+  public:
+
+    //
+    // Reads from 'file', which must stay open for the life of the tile.
+    // The display and data windows are copied from the file's header.
+    // A 'cache_tiles' of 0 keeps one row of file tiles plus one, enough
+    // for a read moving through the image in line order to decode each
+    // file tile once.
+    // If 'read_channels' is not empty only those channels (plus the depth
+    // and deep metadata channels) are read from the file.
+    //
+
+    DeepTiledInputTile (OPENEXR_IMF_NAMESPACE::DeepTiledInputFile& file,
+                        ChannelContext& channel_ctx,
+                        bool tileYup=true,
+                        int cache_tiles=0,
+                        const ChannelSet& read_channels=Mask_None);
+
+    /*virtual*/ ~DeepTiledInputTile ();
+
+
+    //
+    // The file being read.
+    //
+
+    OPENEXR_IMF_NAMESPACE::DeepTiledInputFile& file () const;
+
+
+    //
+    // Number of file tiles kept decoded.
+    //
+
+    int     cacheSize () const;
+
+
+    //
+    // Release all the decoded file tiles.
+    //
+
+    void    clear ();
+
+
+    //
+    // Returns the number of deep samples at pixel x,y.
+    //
+
+    /*virtual*/ size_t getNumSamplesAt (int x, int y) const;
+
+
+    //
+    // Reads deep samples from a pixel-space location (x, y) into a deep pixel,
+    // decoding the file tile first if it's not in the cache.
+    // If xy is out of bounds the deep pixel is left empty and false is returned.
+    //
+
+    /*virtual*/ bool getDeepPixel (int x,
+                                   int y,
+                                   Dcx::DeepPixel& pixel) const;
+
+    /*virtual*/ bool getSampleMetadata (int x,
+                                        int y,
+                                        size_t sample,
+                                        Dcx::DeepMetadata& metadata) const;
+
+
+  protected:
+
+    //
+    // A decoded file tile.
+    //
+
+    struct FileTile
+    {
+        int                                 index;          // dy*numXTiles + dx, -1 if empty
+        IMATH_NAMESPACE::Box2i              window;         // Pixels covered, in file (Y-down) coordinates
+        size_t                              last_use;       // m_use_count at last access, for LRU eviction
+        std::vector<uint32_t>               sample_counts;  // Per-pixel sample count
+        std::vector<size_t>                 sample_offsets; // Per-pixel offset of first sample, plus the total
+        std::vector<std::vector<float> >    samples;        // Packed samples for each of m_file_channels
+
+        FileTile ();
+    };
+
+    //
+    // Returns the cached file tile holding pixel x, file scanline 'file_y',
+    // reading it from the file if it's not in the cache. m_mutex must be locked.
+    //
+
+    const FileTile& loadTile (int x,
+                              int file_y) const;
+
+    //
+    // Offset of pixel x, file scanline 'file_y', in the tile's per-pixel arrays.
+    //
+
+    size_t  pixelIndex (const FileTile& tile,
+                        int x,
+                        int file_y) const;
+
+    //
+    // Point 'channel_values' at each of m_channels' packed samples in the
+    // file tile, starting at 'sample_offset', NULL if the file doesn't have it.
+    //
+
+    void    getChannelValues (const FileTile& tile,
+                              size_t sample_offset,
+                              const float** channel_values) const;
+
+    int     fileY (int y) const;
+
+
+  protected:
+
+    OPENEXR_IMF_NAMESPACE::DeepTiledInputFile* m_file;      // File being read
+    IMATH_NAMESPACE::Box2i          m_file_data_window;     // Data window in file (Y-down) coordinates
+    std::vector<std::string>        m_file_channels;        // Names of the file channels read
+    std::vector<int>                m_chan_index;           // Per-ChannelIdx index into m_file_channels, -1 if none
+    int                             m_file_tile_width;      // File tile size
+    int                             m_file_tile_height;
+    int                             m_num_x_tiles;          // Level 0 tile counts
+    int                             m_num_y_tiles;
+    mutable std::vector<FileTile>   m_tiles;                // Cached file tiles
+    mutable std::vector<int>        m_tile_slots;           // Per-file-tile slot in m_tiles, -1 if not cached
+    mutable size_t                  m_use_count;            // Incremented on each cache access
+    mutable pthread_mutex_t         m_mutex;                // Guards the cache and the file
+
+};
+
+
+
+//-----------------------------------------------------------------------------
+//
+// class DeepTiledOutputTile
+//
+//      Adapter class for an output deep tiled file.
+//
+//      Pixels are stored in DeepLines like DeepImageOutputTile, but
+//      setOutputFile() creates an Imf::DeepTiledOutputFile and the lines
+//      are written a row of file tiles at a time.  writeScanline() marks
+//      the lines handed to it and writes a row of file tiles once all of
+//      its lines have been, so code that writes a DeepImageOutputTile one
+//      line at a time works unchanged.  Rows still unwritten when the file
+//      is replaced or the tile destroyed are written as they are.
+//
+//-----------------------------------------------------------------------------
+
+class DCX_EXPORT DeepTiledOutputTile : public DeepImageOutputTile
+{
+  public:
+
+    //
+    // Sets resolution, channel info and the file tile size.
+    //
+
+    DeepTiledOutputTile (const IMATH_NAMESPACE::Box2i& display_window,
+                         const IMATH_NAMESPACE::Box2i& data_window,
+                         bool sourceWindowsYup,
+                         const ChannelAliasPtrSet& channels,
+                         ChannelContext& channel_ctx,
+                         bool tileYup=true,
+                         int file_tile_width=64,
+                         int file_tile_height=64);
+
+    //
+    // Copy resolution and channel info from another DeepTile.
+    // No pixel data is copied.
+    //
+
+    DeepTiledOutputTile (const DeepTile& tile,
+                         int file_tile_width=64,
+                         int file_tile_height=64);
+
+    /*virtual*/ ~DeepTiledOutputTile ();
+
+
+    int     fileTileWidth () const;
+    int     fileTileHeight () const;
+
+
+    //
+    // Create an output deep tiled file linked to this tile - destructive!
+    // Will allocate a new Imf::DeepTiledOutputFile and assign its
+    // channels, destroying any current file.
+    // The line order is in the tile's Y direction and flipped for Y-up like
+    // DeepImageOutputTile, ex. if rows are finished from y() to t() use
+    // INCREASING_Y.  Rows can still be finished in any order, but for
+    // INCREASING_Y and DECREASING_Y OpenEXR holds each tile that arrives
+    // ahead of its turn in memory until the tiles before it are written.
+    // Use RANDOM_Y to write every tile as soon as its row is finished.
+    //
+
+    /*virtual*/ void setOutputFile (const char* filename,
+                                    OPENEXR_IMF_NAMESPACE::LineOrder line_order=OPENEXR_IMF_NAMESPACE::INCREASING_Y,
+                                    OPENEXR_IMF_NAMESPACE::Compression compression=OPENEXR_IMF_NAMESPACE::ZIPS_COMPRESSION,
+                                    const OPENEXR_IMF_NAMESPACE::Header* attributes=0);
+
+
+    //
+    // Mark line y as finished.  Once every line of a row of file tiles is
+    // finished the row is written.  Lines may be finished in any order.
+    // If flush_line is true the row's DeepLine memory is freed after writing.
+    //
+
+    /*virtual*/ void writeScanline (int y,
+                                    bool flush_line=true);
+
+
+    //
+    // Write every row of file tiles not yet written.
+    // If flush_tile is true all DeepLine memory is freed.
+    //
+
+    /*virtual*/ void writeTile (bool flush_tile=true);
+
+
+    //
+    // Write the file tiles in row 'dy', regardless of how many of its lines
+    // are finished.  If flush_lines is true the row's DeepLine memory is freed.
+    //
+
+    void    writeTileRow (int dy,
+                          bool flush_lines=true);
+
+
+  protected:
+
+    int     fileY (int y) const;
+    int     tileY (int file_y) const;
+
+    void    writeFileTile (int dx,
+                           int dy,
+                           std::vector<uint32_t>& line_offsets);
+
+
+  protected:
+
+    OPENEXR_IMF_NAMESPACE::DeepTiledOutputFile* m_tiled_file; // Output file, if assigned
+    IMATH_NAMESPACE::Box2i          m_file_data_window;     // Data window in file (Y-down) coordinates
+    int                             m_file_tile_width;      // File tile size
+    int                             m_file_tile_height;
+    std::vector<int>                m_row_lines;            // Per-tile-row count of finished lines, -1 once written
+    std::vector<bool>               m_line_finished;        // Per-tile-line, has writeScanline() been called for it?
+
+};
+
+
+
+//-----------------
+// Inline Functions
+//-----------------
+
+inline
+OPENEXR_IMF_NAMESPACE::DeepTiledInputFile& DeepTiledInputTile::file () const { return *m_file; }
+inline
+int DeepTiledInputTile::cacheSize () const { return int(m_tiles.size()); }
+inline
+int DeepTiledInputTile::fileY (int y) const { return (m_tile_yUp)?(m_display_window.max.y - y):y; }
+inline
+size_t DeepTiledInputTile::pixelIndex (const FileTile& tile,
+                                       int x,
+                                       int file_y) const {
+    return size_t(file_y - tile.window.min.y)*size_t(tile.window.max.x - tile.window.min.x + 1) +
+           size_t(x - tile.window.min.x); }
+//--------------------------------------------------------
+inline
+int DeepTiledOutputTile::fileTileWidth () const { return m_file_tile_width; }
+inline
+int DeepTiledOutputTile::fileTileHeight () const { return m_file_tile_height; }
+inline
+int DeepTiledOutputTile::fileY (int y) const { return (m_tile_yUp)?(m_display_window.max.y - y):y; }
+inline
+int DeepTiledOutputTile::tileY (int file_y) const { return (m_tile_yUp)?(m_display_window.max.y - file_y):file_y; }
+
+
+OPENDCX_INTERNAL_NAMESPACE_HEADER_EXIT
+
+#endif // INCLUDED_DCX_DEEPTILEDTILE_H
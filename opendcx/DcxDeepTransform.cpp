@@ -38,7 +38,10 @@
 
 #include "DcxDeepTransform.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define SSAMPLING_MAX 8
 
@@ -73,13 +76,18 @@ static GlobalLock g_lock;
 DeepTransform::DeepTransform (int super_sampling,
                               FilterMode filter_mode) :
     m_updated(false),
+    m_affine(true),
+    m_translate(true),
     m_zTranslate(0.0f),
     m_zScale(1.0f),
     m_filter_mode(filter_mode),
-    m_ss_factor(std::max(1, std::min(super_sampling, 32)))
+    m_ss_factor(std::max(1, std::min(super_sampling, 32))),
+    m_filter_margin(0),
+    m_phases(0)
 {
     m_matrix.makeIdentity();  // << may be redundant, think M44 ctor does this
     m_imatrix.makeIdentity(); // << may be redundant, think M44 ctor does this
+    m_filter_margin = buildFilterTable(m_filter_mode, std::min(m_ss_factor, SSAMPLING_MAX), m_filter_table);
 }
 
 DeepTransform::DeepTransform (const IMATH_NAMESPACE::M44f& m,
@@ -87,12 +95,16 @@ DeepTransform::DeepTransform (const IMATH_NAMESPACE::M44f& m,
                               FilterMode filter_mode) :
     m_matrix(m),
     m_updated(false),
+    m_affine(true),
+    m_translate(true),
     m_zTranslate(0.0f),
     m_zScale(1.0f),
     m_filter_mode(filter_mode),
-    m_ss_factor(std::max(1, std::min(super_sampling, 32)))
+    m_ss_factor(std::max(1, std::min(super_sampling, 32))),
+    m_filter_margin(0),
+    m_phases(0)
 {
-    //
+    m_filter_margin = buildFilterTable(m_filter_mode, std::min(m_ss_factor, SSAMPLING_MAX), m_filter_table);
 }
 
 /*virtual*/
@@ -112,7 +124,28 @@ DeepTransform::imatrix()
         g_lock.lock();
         if (!m_updated)
         {
-            m_imatrix = m_matrix.inverse();
+            // Is it only a translation, ie. everything but the bottom row is identity?
+            m_translate = (m_matrix[3][3] == 1.0f);
+            for (int i=0; i < 3; ++i)
+                for (int j=0; j < 4; ++j)
+                    if (m_matrix[i][j] != ((i == j)?1.0f:0.0f))
+                        m_translate = false;
+            if (m_translate)
+            {
+                // Keep the inverse exact so whole-pixel offsets stay whole:
+                m_imatrix = m_matrix;
+                m_imatrix[3][0] = -m_matrix[3][0];
+                m_imatrix[3][1] = -m_matrix[3][1];
+                m_imatrix[3][2] = -m_matrix[3][2];
+            }
+            else
+                m_imatrix = m_matrix.inverse();
+            m_affine = (m_imatrix[0][3] == 0.0f && m_imatrix[1][3] == 0.0f && m_imatrix[3][3] == 1.0f);
+            // Footprints are rebuilt for the new matrix as they're needed:
+            m_phases = SpMask8::width*std::min(std::max(m_ss_factor, 1), SSAMPLING_MAX);
+            m_footprints.clear();
+            m_footprints.resize(m_phases*m_phases);
+            m_footprint_built.assign(m_phases*m_phases, 0);
             m_updated = true;
         }
         g_lock.unlock();
@@ -121,6 +154,19 @@ DeepTransform::imatrix()
 }
 
 
+void
+DeepTransform::setJitteredSampling (bool enable)
+{
+    if (enable == jitteredSampling())
+        return;
+    if (enable)
+        buildJitterTable(SpMask8::width*std::min(m_ss_factor, SSAMPLING_MAX) + 2*m_filter_margin, m_jitter_table);
+    else
+        m_jitter_table.clear();
+    m_updated = false; // rebuild footprints
+}
+
+
 //-------------------------------------------------------------------------------
 
 #if 1
@@ -170,6 +216,353 @@ DeepTransform::transform (const IMATH_NAMESPACE::Box2i& in,
     //std::cout << "  out" << out << " [" << (out.max.x - out.min.x + 1) << " " << (out.max.y - out.min.y + 1) << "]" << std::endl;
 }
 
+//-------------------------------------------------------------------------------
+
+/*static*/
+void
+DeepTransform::backProjectSupersamples (float x0,
+                                        float y0,
+                                        float step,
+                                        int superW,
+                                        int ss_factor,
+                                        int margin,
+                                        const IMATH_NAMESPACE::M44f& m,
+                                        const float* jitter,
+                                        SupersampleHit* hits)
+{
+    const float fmaskW = float(SpMask8::width);
+    for (int spSupOutY=-margin; spSupOutY < superW+margin; ++spSupOutY)
+    {
+        const int spOutY = (spSupOutY >= 0 && spSupOutY < superW)?spSupOutY / ss_factor:-1;
+        for (int spSupOutX=-margin; spSupOutX < superW+margin; ++spSupOutX, ++hits)
+        {
+            float ssX = float(spSupOutX);
+            float ssY = float(spSupOutY);
+            if (jitter)
+            {
+                ssX += jitter[0];
+                ssY += jitter[1];
+                jitter += 2;
+            }
+            const IMATH_NAMESPACE::V3f p = XY_x_M44(x0 + ssX*step, y0 + ssY*step, m);
+            const float flr_inX = floorf(p.x);
+            const float flr_inY = floorf(p.y);
+            hits->inX = int(flr_inX);
+            hits->inY = int(flr_inY);
+            // Sample location in input spmask. A location just under a whole
+            // pixel can round up to the pixel's far edge, so clamp it:
+            const int spInX = std::min(int(floorf((p.x - flr_inX)*fmaskW)), SpMask8::width-1);
+            const int spInY = std::min(int(floorf((p.y - flr_inY)*fmaskW)), SpMask8::width-1);
+            hits->in_bit  = spInY*SpMask8::width + spInX;
+            hits->out_bin = (spOutY >= 0 && spSupOutX >= 0 && spSupOutX < superW)?
+                                spOutY*SpMask8::width + spSupOutX / ss_factor:-1;
+            hits->gridX = spSupOutX + margin;
+            hits->gridY = spSupOutY + margin;
+        }
+    }
+}
+
+
+/*static*/
+void
+DeepTransform::stepSupersamples (const IMATH_NAMESPACE::V2f& origin,
+                                 float step,
+                                 int superW,
+                                 int ss_factor,
+                                 int margin,
+                                 const IMATH_NAMESPACE::M44f& m,
+                                 const float* jitter,
+                                 SupersampleHit* hits)
+{
+    const float fmaskW = float(SpMask8::width);
+    // Input-space deltas for one supersample step in x and y:
+    const float dPdx_x = m[0][0]*step, dPdx_y = m[0][1]*step;
+    const float dPdy_x = m[1][0]*step, dPdy_y = m[1][1]*step;
+
+    for (int spSupOutY=-margin; spSupOutY < superW+margin; ++spSupOutY)
+    {
+        const int spOutY = (spSupOutY >= 0 && spSupOutY < superW)?spSupOutY / ss_factor:-1;
+        // Start each row from the origin so errors don't build up down the grid:
+        float finX = origin.x + float(spSupOutY)*dPdy_x - float(margin)*dPdx_x;
+        float finY = origin.y + float(spSupOutY)*dPdy_y - float(margin)*dPdx_y;
+        for (int spSupOutX=-margin; spSupOutX < superW+margin; ++spSupOutX, ++hits)
+        {
+            float pX = finX;
+            float pY = finY;
+            if (jitter)
+            {
+                pX += jitter[0]*dPdx_x + jitter[1]*dPdy_x;
+                pY += jitter[0]*dPdx_y + jitter[1]*dPdy_y;
+                jitter += 2;
+            }
+            const float flr_inX = floorf(pX);
+            const float flr_inY = floorf(pY);
+            hits->inX = int(flr_inX);
+            hits->inY = int(flr_inY);
+            // Sample location in input spmask. A location just under a whole
+            // pixel can round up to the pixel's far edge, so clamp it:
+            const int spInX = std::min(int(floorf((pX - flr_inX)*fmaskW)), SpMask8::width-1);
+            const int spInY = std::min(int(floorf((pY - flr_inY)*fmaskW)), SpMask8::width-1);
+            hits->in_bit  = spInY*SpMask8::width + spInX;
+            hits->out_bin = (spOutY >= 0 && spSupOutX >= 0 && spSupOutX < superW)?
+                                spOutY*SpMask8::width + spSupOutX / ss_factor:-1;
+            hits->gridX = spSupOutX + margin;
+            hits->gridY = spSupOutY + margin;
+            finX += dPdx_x;
+            finY += dPdx_y;
+        }
+    }
+}
+
+
+bool
+DeepTransform::SupersampleHit::operator < (const SupersampleHit& b) const
+{
+    if (inY != b.inY) return (inY < b.inY);
+    if (inX != b.inX) return (inX < b.inX);
+    if (out_bin != b.out_bin) return (out_bin < b.out_bin);
+    return (in_bit < b.in_bit);
+}
+
+bool
+DeepTransform::SupersampleHit::sameOutputBin (const SupersampleHit& b) const
+{
+    return (inX == b.inX && inY == b.inY && out_bin == b.out_bin);
+}
+
+
+/*static*/
+void
+DeepTransform::buildFootprint (const std::vector<SupersampleHit>& hits,
+                               int baseX,
+                               int baseY,
+                               const float* filter_table,
+                               int grid_width,
+                               Footprint& footprint)
+{
+    footprint.clear();
+
+    std::vector<SupersampleHit> sorted(hits);
+    std::sort(sorted.begin(), sorted.end());
+
+    // Filter weight accumulators, indexed by in_bit*numBits + out_bin:
+    std::vector<float> in_weights;
+    if (filter_table)
+        in_weights.resize(SpMask8::numBits*SpMask8::numBits);
+
+    const size_t nHits = sorted.size();
+    size_t i = 0;
+    while (i < nHits)
+    {
+        // Start a new input pixel:
+        const SupersampleHit& pixel_start = sorted[i];
+        FootprintPixel fp;
+        fp.dx = pixel_start.inX - baseX;
+        fp.dy = pixel_start.inY - baseY;
+        if (filter_table)
+        {
+            // Each supersample adds its 2D kernel weight, the product of
+            // its column & row weights, to every output bin it reaches:
+            std::fill(in_weights.begin(), in_weights.end(), 0.0f);
+            for (; i < nHits && sorted[i].inX == pixel_start.inX && sorted[i].inY == pixel_start.inY; ++i)
+            {
+                const SupersampleHit& hit = sorted[i];
+                float* out_weights = &in_weights[hit.in_bit*SpMask8::numBits];
+                for (int by=0; by < SpMask8::width; ++by)
+                {
+                    const float wy = filter_table[by*grid_width + hit.gridY];
+                    if (wy == 0.0f)
+                        continue;
+                    for (int bx=0; bx < SpMask8::width; ++bx)
+                        out_weights[by*SpMask8::width + bx] += wy*filter_table[bx*grid_width + hit.gridX];
+                }
+            }
+            for (int in_bit=0; in_bit < SpMask8::numBits; ++in_bit)
+            {
+                for (int out_bin=0; out_bin < SpMask8::numBits; ++out_bin)
+                {
+                    const float weight = in_weights[in_bit*SpMask8::numBits + out_bin];
+                    if (weight == 0.0f)
+                        continue;
+                    FootprintWeight fw;
+                    fw.in_bit  = in_bit;
+                    fw.out_bin = out_bin;
+                    fw.weight  = weight;
+                    fp.weights.push_back(fw);
+                }
+            }
+            footprint.push_back(fp);
+            continue;
+        }
+        while (i < nHits && sorted[i].inX == pixel_start.inX && sorted[i].inY == pixel_start.inY)
+        {
+            // Each output bin gets a FootprintBin for each time an input
+            // bin lands in it, the n'th holding the input bins hit n+ times:
+            const SupersampleHit& bin_start = sorted[i];
+            const size_t first_layer = fp.bins.size();
+            while (i < nHits && sorted[i].sameOutputBin(bin_start))
+            {
+                const int in_bit = sorted[i].in_bit;
+                for (size_t layer=first_layer;
+                     i < nHits && sorted[i].sameOutputBin(bin_start) && sorted[i].in_bit == in_bit;
+                     ++i, ++layer)
+                {
+                    if (layer == fp.bins.size())
+                    {
+                        FootprintBin bin;
+                        bin.in_bits = 0ull;
+                        bin.out_bin = bin_start.out_bin;
+                        fp.bins.push_back(bin);
+                    }
+                    fp.bins[layer].in_bits |= (1ull << in_bit);
+                }
+            }
+        }
+        footprint.push_back(fp);
+    }
+}
+
+
+// Radius of a filter mode's kernel, in output subpixel bins:
+static float
+filterRadius (DeepTransform::FilterMode filter_mode)
+{
+    switch (filter_mode)
+    {
+    case DeepTransform::FILTER_GAUSSIAN: return 1.5f;
+    case DeepTransform::FILTER_MITCHELL: return 2.0f;
+    case DeepTransform::FILTER_LANCZOS:  return 3.0f;
+    default:                             return 0.5f;
+    }
+}
+
+// Filter mode's kernel at distance d (in output subpixel bins) from its center:
+static float
+filterKernel (DeepTransform::FilterMode filter_mode,
+              float d)
+{
+    d = fabsf(d);
+    if (d >= filterRadius(filter_mode))
+        return 0.0f;
+    switch (filter_mode)
+    {
+    case DeepTransform::FILTER_GAUSSIAN:
+        // sigma = 0.5 bin:
+        return expf(-2.0f*d*d);
+    case DeepTransform::FILTER_MITCHELL:
+    {
+        const float B = 1.0f/3.0f;
+        const float C = 1.0f/3.0f;
+        if (d < 1.0f)
+            return ((12.0f - 9.0f*B - 6.0f*C)*d*d*d + (-18.0f + 12.0f*B + 6.0f*C)*d*d + (6.0f - 2.0f*B)) / 6.0f;
+        return ((-B - 6.0f*C)*d*d*d + (6.0f*B + 30.0f*C)*d*d + (-12.0f*B - 48.0f*C)*d + (8.0f*B + 24.0f*C)) / 6.0f;
+    }
+    case DeepTransform::FILTER_LANCZOS:
+    {
+        if (d < 1.0e-6f)
+            return 1.0f;
+        const float pd = float(M_PI)*d;
+        return 3.0f*sinf(pd)*sinf(pd/3.0f) / (pd*pd);
+    }
+    default:
+        return 1.0f;
+    }
+}
+
+
+/*static*/
+int
+DeepTransform::buildFilterTable (FilterMode filter_mode,
+                                 int ss_factor,
+                                 std::vector<float>& table)
+{
+    table.clear();
+    if (filter_mode == FILTER_NEAREST || filter_mode == FILTER_BOX)
+        return 0;
+
+    // Pad the grid so the outermost bins' kernels are fully covered:
+    const float radius = filterRadius(filter_mode);
+    const int margin = int(ceilf((radius - 0.5f)*float(ss_factor)));
+    const int grid_width = SpMask8::width*ss_factor + 2*margin;
+
+    table.resize(SpMask8::width*grid_width, 0.0f);
+    for (int b=0; b < SpMask8::width; ++b)
+    {
+        float* row = &table[b*grid_width];
+        float sum = 0.0f;
+        for (int g=0; g < grid_width; ++g)
+        {
+            // Supersample center relative to bin center:
+            const float d = (float(g - margin) + 0.5f)/float(ss_factor) - (float(b) + 0.5f);
+            row[g] = filterKernel(filter_mode, d);
+            sum += row[g];
+        }
+        for (int g=0; g < grid_width; ++g)
+            row[g] /= sum;
+    }
+    return margin;
+}
+
+
+/*static*/
+void
+DeepTransform::buildJitterTable (int grid_width,
+                                 std::vector<float>& table)
+{
+    // R2 sequence - the generalized golden ratio sequence for 2D, with
+    // alpha = (1/g, 1/g^2) where g is the plastic number:
+    const double alphaX = 0.7548776662466927;
+    const double alphaY = 0.5698402909980532;
+    const int nCells = grid_width*grid_width;
+    table.resize(nCells*2);
+    for (int i=0; i < nCells; ++i)
+    {
+        const double u = 0.5 + alphaX*double(i);
+        const double v = 0.5 + alphaY*double(i);
+        // Keep clear of the cell's far edge after rounding to float:
+        table[i*2  ] = std::min(float(u - floor(u) - 0.5), 0.4999f);
+        table[i*2+1] = std::min(float(v - floor(v) - 0.5), 0.4999f);
+    }
+}
+
+
+const DeepTransform::Footprint&
+DeepTransform::affineFootprint (float inX,
+                                float inY,
+                                int& baseX,
+                                int& baseY)
+{
+    // Round to the nearest phase, which may be the next pixel's first:
+    const float flr_inX = floorf(inX);
+    const float flr_inY = floorf(inY);
+    int phaseX = int(floorf((inX - flr_inX)*float(m_phases) + 0.5f));
+    int phaseY = int(floorf((inY - flr_inY)*float(m_phases) + 0.5f));
+    baseX = int(flr_inX);
+    baseY = int(flr_inY);
+    if (phaseX >= m_phases) { phaseX = 0; ++baseX; }
+    if (phaseY >= m_phases) { phaseY = 0; ++baseY; }
+
+    // sample() may be called from several threads on one transform, so only
+    // look at or build the footprint while holding the lock.  Once built a
+    // footprint isn't modified until the matrix changes:
+    const int phase = phaseY*m_phases + phaseX;
+    ScopedMutexLock lock(&m_footprint_mutex.m_mutex);
+    if (!m_footprint_built[phase])
+    {
+        const int ss_factor = m_phases / SpMask8::width;
+        const int superW = SpMask8::width*ss_factor;
+        const int gridW = superW + 2*m_filter_margin;
+        std::vector<SupersampleHit> hits(gridW*gridW);
+        stepSupersamples(IMATH_NAMESPACE::V2f(float(phaseX)/float(m_phases), float(phaseY)/float(m_phases)),
+                         1.0f/float(superW), superW, ss_factor, m_filter_margin, m_imatrix,
+                         (m_jitter_table.empty())?NULL:&m_jitter_table[0], &hits[0]);
+        buildFootprint(hits, 0, 0, (m_filter_table.empty())?NULL:&m_filter_table[0], gridW, m_footprints[phase]);
+        m_footprint_built[phase] = 1;
+    }
+    return m_footprints[phase];
+}
+
+
 //-------------------------------------------------------------------------------
 
 /*virtual*/
@@ -227,7 +620,16 @@ DeepTransform::sample (int outX,
         return;
 #endif
 
-    Dcx::DeepPixel in_pixel(deep_in_tile.channels());
+    // The filtered modes still resample a fractional translation:
+    if (m_translate && (m_filter_mode == FILTER_BOX ||
+                        (m_imatrix[3][0] == floorf(m_imatrix[3][0]) &&
+                         m_imatrix[3][1] == floorf(m_imatrix[3][1]))))
+    {
+        sampleTranslation(outX, outY, deep_in_tile, out_pixel);
+        return;
+    }
+
+    Dcx::DeepPixel in_scratch(deep_in_tile.channels());
 
     //=============================================================
     // Partial-transparency filtering
@@ -238,248 +640,582 @@ DeepTransform::sample (int outX,
     const int   superW = (int)SpMask8::width*ss_factor; // 32
     const float ifsuperW = 1.0f/float(superW);
     const float ss_factor_center = 0.5f/float(superW);
-    const float fmaskW = float(SpMask8::width);
     const float foutX = float(outX);
     const float foutY = float(outY);
-    float finX, finY;
 #ifdef DCX_DEBUG_TRANSFORM
     if (debug) std::cout << ", ss_factor=" << ss_factor << ", ss_factor_sqr=" << ss_factor_sqr << std::endl;
 #endif
 
+    // Find the input pixels and bins the output supersamples land in.
+    // Affine matrices share footprints between all output pixels with
+    // the same input phase:
+    const Footprint* footprint;
+    Footprint pixel_footprint;
+    int baseX = 0, baseY = 0;
+    const IMATH_NAMESPACE::M44f& im = imatrix(); // updates m_affine too
+    if (m_affine)
+    {
+        const IMATH_NAMESPACE::V3f origin = XY_x_M44(foutX + ss_factor_center, foutY + ss_factor_center, im);
+        footprint = &affineFootprint(origin.x, origin.y, baseX, baseY);
+    }
+    else
+    {
+        const int gridW = superW + 2*m_filter_margin;
+        std::vector<SupersampleHit> ss_hits(gridW*gridW);
+        backProjectSupersamples(foutX + ss_factor_center, foutY + ss_factor_center,
+                                ifsuperW, superW, ss_factor, m_filter_margin, im,
+                                (m_jitter_table.empty())?NULL:&m_jitter_table[0], &ss_hits[0]);
+        buildFootprint(ss_hits, 0, 0, (m_filter_table.empty())?NULL:&m_filter_table[0], gridW, pixel_footprint);
+        footprint = &pixel_footprint;
+    }
+    const bool filtered = !m_filter_table.empty();
+
     char    bin_hits[SpMask8::numBits];
+    char    full_bin_hits[SpMask8::numBits];
     std::vector<char> ss_weight_counts(ss_factor_sqr);   //char    ss_weight_counts[ss_factor_sqr];
     std::vector<SpMask8> ss_weight_masks(ss_factor_sqr); //SpMask8 ss_weight_masks[ss_factor_sqr];
     SpMask8 out_mask, out_opaque_mask, out_transp_mask;
+    SpMask8 full_out_mask, full_out_opaque_mask;
 
-    // Iterate through input pixel range, finding segments that contribute to the output pixel,
-    // and resampling the masks:
-    for (int tY=in.min.y; tY <= in.max.y; ++tY)
+    // Iterate through the footprint's input pixels, finding segments that contribute
+    // to the output pixel, and resampling the masks:
+    const size_t nFootprintPixels = footprint->size();
+    for (size_t fpi=0; fpi < nFootprintPixels; ++fpi)
     {
-        for (int tX=in.min.x; tX <= in.max.x; ++tX)
-        {
-            // Get the deep pixel from the deep tile:
-            deep_in_tile.getDeepPixel(tX, tY, in_pixel);
-            const size_t nSegments = in_pixel.size();
+        const FootprintPixel& fp = (*footprint)[fpi];
+        const int tX = baseX + fp.dx;
+        const int tY = baseY + fp.dy;
+        if (tX < deep_in_tile.x() || tX > deep_in_tile.r() ||
+            tY < deep_in_tile.y() || tY > deep_in_tile.t())
+            continue;
+
+        // Get the deep pixel from the deep tile:
+        const Dcx::DeepPixel& in_pixel = *deep_in_tile.peekDeepPixel(tX, tY, in_scratch);
+        const size_t nSegments = in_pixel.size();
 #ifdef DCX_DEBUG_TRANSFORM
-            if (debug) {
-                std::cout << "  --------------------------------------------------------------------" << std::endl;
-                std::cout << "  in[" << tX << " " << tY << "] segments=" << nSegments << std::endl;
-            }
+        if (debug) {
+            std::cout << "  --------------------------------------------------------------------" << std::endl;
+            std::cout << "  in[" << tX << " " << tY << "] segments=" << nSegments << std::endl;
+        }
 #endif
 
-            if (nSegments == 0)
-                continue;
-            assert(nSegments < 10000); // just in case...
+        if (nSegments == 0)
+            continue;
+        assert(nSegments < 10000); // just in case...
 
-            // There's input subpixel masks, so resample them:
-            for (size_t segment=0; segment < nSegments; ++segment)
-            {
-                // Get input segment:
-                const DeepSegment& in_segment = in_pixel.getSegment(segment);
-                const SpMask8 in_mask = (!in_segment.zeroCoverage())?in_segment.spMask():SpMask8::fullCoverage;
+        const size_t nBins = fp.bins.size();
+        const size_t nWeights = fp.weights.size();
+        bool have_full_hits = false;
+
+        // There's input subpixel masks, so resample them:
+        for (size_t segment=0; segment < nSegments; ++segment)
+        {
+            // Get input segment:
+            const DeepSegment& in_segment = in_pixel.getSegment(segment);
+            const SpMask8 in_mask = (!in_segment.zeroCoverage())?in_segment.spMask():SpMask8::fullCoverage;
 
 #ifdef DCX_DEBUG_TRANSFORM
-                if (debug) {
-                    std::cout << "   -----------------------------" << std::endl;
-                    std::cout << "   " << segment << " Zf=" << in_segment.Zf << ", Zb=" << in_segment.Zb << std::endl;
-                    std::cout << "   mask:" << std::endl;
-                    in_mask.printPattern(std::cout, "   ");
-                }
+            if (debug) {
+                std::cout << "   -----------------------------" << std::endl;
+                std::cout << "   " << segment << " Zf=" << in_segment.Zf << ", Zb=" << in_segment.Zb << std::endl;
+                std::cout << "   mask:" << std::endl;
+                in_mask.printPattern(std::cout, "   ");
+            }
 #endif
+            if (in_mask == SpMask8::fullCoverage && have_full_hits)
+            {
+                // Same result as the last full-coverage segment:
+                memcpy(bin_hits, full_bin_hits, SpMask8::numBits);
+                out_mask = full_out_mask;
+                out_opaque_mask = full_out_opaque_mask;
+            }
+            else
+            {
+                // Build up the bin-hit counts and accumulated masks from
+                // the footprint bins that overlap the input mask:
                 out_mask = out_opaque_mask = SpMask8::zeroCoverage;
                 memset(bin_hits, 0, SpMask8::numBits);
-
-                // Sample subpixel locations at a potentially higher rate and stochastically(TODO)
-                // than 8x8, building up the bin-hit counts and accumulated masks:
-                for (int spSupOutY=(superW-1); spSupOutY >= 0; --spSupOutY)
+                const uint64_t in_bits = in_mask.value();
+                if (filtered)
                 {
-#ifdef DCX_DEBUG_TRANSFORM
-                    if (debug) std::cout << "  ";
-#endif
-                    const int spOutY = spSupOutY / ss_factor;
-                    for (int spSupOutX=0; spSupOutX < superW; ++spSupOutX)
+                    // Sum the kernel weights of the covered input bins, then
+                    // quantize them to supersample counts so they're output
+                    // like the box filter's. Negative lobes can take a
+                    // partially-covered bin out of the 0-1 range, so clamp it:
+                    float bin_weights[SpMask8::numBits];
+                    for (int out_bin=0; out_bin < SpMask8::numBits; ++out_bin)
+                        bin_weights[out_bin] = 0.0f;
+                    for (size_t w=0; w < nWeights; ++w)
+                        if (in_bits & (1ull << fp.weights[w].in_bit))
+                            bin_weights[fp.weights[w].out_bin] += fp.weights[w].weight;
+                    for (int out_bin=0; out_bin < SpMask8::numBits; ++out_bin)
                     {
-                        const int spOutX = spSupOutX / ss_factor;
-                        // Back-project input subpixel coordinate into output space:
-                        // (TODO: can this be a dPdx/dpDy interpolation routine instead?)
-                        // (TODO: jitter this stochastically too!)
-                        backTransform(foutX + ss_factor_center + float(spSupOutX)*ifsuperW,
-                                      foutY + ss_factor_center + float(spSupOutY)*ifsuperW,
-                                      finX, finY);
-                        const float flr_inX = floorf(finX);
-                        const float flr_inY = floorf(finY);
-                        const int inX = int(flr_inX);
-                        const int inY = int(flr_inY);
-                        // Skip if it projects outside the current output pixel:
-                        if (inX != tX || inY != tY)
-#ifdef DCX_DEBUG_TRANSFORM
-                        {
-                            if (debug) std::cout << " [   ]  ";
-                            continue;
-                        }
-#else
-                            continue;
-#endif
+                        const int nHits = int(floorf(bin_weights[out_bin]*float(ss_factor_sqr) + 0.5f));
+                        bin_hits[out_bin] = char(std::max(0, std::min(nHits, ss_factor_sqr)));
+                    }
+                }
+                else
+                {
+                    for (size_t b=0; b < nBins; ++b)
+                        bin_hits[fp.bins[b].out_bin] += char(ChannelSet::bitCount(in_bits & fp.bins[b].in_bits));
+                }
+                SpMask8 out_sp(1ull);
+                for (int out_bin=0; out_bin < SpMask8::numBits; ++out_bin, out_sp <<= 1)
+                {
+                    if (bin_hits[out_bin] == 0)
+                        continue;
+                    out_mask |= out_sp;
+                    if (bin_hits[out_bin] >= ss_factor_sqr)
+                        out_opaque_mask |= out_sp;
+                }
+                if (in_mask == SpMask8::fullCoverage)
+                {
+                    memcpy(full_bin_hits, bin_hits, SpMask8::numBits);
+                    full_out_mask = out_mask;
+                    full_out_opaque_mask = out_opaque_mask;
+                    have_full_hits = true;
+                }
+            }
 
-                        // Sample location in input spmask:
-                        const int spInX = int(floorf((finX - flr_inX)*fmaskW));
-                        const int spInY = int(floorf((finY - flr_inY)*fmaskW));
+            // Skip this segment if it doesn't overlap any output bins:
+            if (out_mask == SpMask8::zeroCoverage)
 #ifdef DCX_DEBUG_TRANSFORM
-                        if (debug) std::cout << " [" << spInX << " " << spInY << "]";
+            {
+                if (debug) std::cout << "     no output overlap, skip segment " << segment << std::endl;
+                continue;
+            }
+#else
+                continue;
 #endif
 
-                        // Get input spmask bit:
-                        const SpMask8 in_sp = SpMask8(1ull) << (spInY*SpMask8::width + spInX);
-                        if (in_mask & in_sp)
-                        {
-                            // Increment hit-count for this output bin:
-                            const int out_bin = spOutY*SpMask8::width + spOutX;
-                            assert(out_bin < (int)SpMask8::numBits);
-                            const SpMask8 out_sp = SpMask8(1ull) << out_bin;
-                            out_mask |= out_sp;
-                            ++bin_hits[out_bin];
-                            if (bin_hits[out_bin] >= ss_factor_sqr)
-                                out_opaque_mask |= out_sp;
-#ifdef DCX_DEBUG_TRANSFORM
-                            if (debug) std::cout << "=" << std::dec << (int)bin_hits[out_bin];
-#endif
-                        }
-#ifdef DCX_DEBUG_TRANSFORM
-                        else
-                        {
-                            if (debug) std::cout << "  ";
-                        }
-#endif
+            // Write the opaque sample if the mask is non-zero:
+            if (out_opaque_mask != SpMask8::zeroCoverage) {
+                DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
+                // Update output metadata:
+                out_segment.metadata.spmask = out_opaque_mask;
+                out_segment.metadata.flags &= ~DEEP_PARTIAL_BIN_COVERAGE;
+            }
 
-                    } // spInX loop
-#ifdef DCX_DEBUG_TRANSFORM
-                    if (debug) std::cout << std::endl;
+            // Write partially-transparent segment if segment is included in accumulated transp mask:
+            // The transparent mask is the bins that are on but not opaque:
+            out_transp_mask = (out_mask & ~out_opaque_mask);
+#if 0//def DCX_DEBUG_TRANSFORM
+            if (debug) {
+                std::cout << "   out_mask" << std::endl;
+                out_mask.printPattern(std::cout, "   ");
+                std::cout << "   out_opaque_mask" << std::endl;
+                out_opaque_mask.printPattern(std::cout, "   ");
+                std::cout << "   out_transp_mask" << std::endl;
+                out_transp_mask.printPattern(std::cout, "   ");
+            }
 #endif
+            if (out_transp_mask != SpMask8::zeroCoverage)
+            {
+                // Determine weights for each bin, then output the dominant weight, or
+                // separate segments with the separate weights separated by subpixel bits:
+                memset(&ss_weight_counts[0], 0, ss_factor_sqr);
+                memset(&ss_weight_masks[0], 0, ss_factor_sqr*sizeof(SpMask8));
 
-                } // spInY loop
-
-                // Skip this segment if it doesn't overlap any output bins:
-                if (out_mask == SpMask8::zeroCoverage)
-#ifdef DCX_DEBUG_TRANSFORM
+                float average_weight = 0.0f;
+                int transp_hits = 0;
+                SpMask8 count_mask(1ull);
+                for (int sp_bin=0; sp_bin < SpMask8::numBits; ++sp_bin, count_mask <<= 1)
                 {
-                    if (debug) std::cout << "     no output overlap, skip segment " << segment << std::endl;
-                    continue;
+                    const int nHits = bin_hits[sp_bin];
+                    if (nHits == 0 || nHits >= ss_factor_sqr)
+                         continue;
+                    // Increment weight count for ss bin:
+                    ++ss_weight_counts[nHits];
+                    ss_weight_masks[nHits] |= (SpMask8(1ull) << sp_bin);
+                    //
+                    const float bin_weight = float(nHits) / float(ss_factor_sqr);
+                    average_weight += bin_weight;
+                    ++transp_hits;
                 }
-#else
-                    continue;
-#endif
-
-                // Write the opaque sample if the mask is non-zero:
-                if (out_opaque_mask != SpMask8::zeroCoverage) {
+                //
+                if (1)
+                {
+                    // Output separate segments for each weight bin, building a unique
+                    // subpixel mask for each:
+                    for (int i=1; i < ss_factor_sqr; ++i)
+                    {
+                        const int weight_count = ss_weight_counts[i];
+                        if (weight_count == 0)
+                            continue;
+                        DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
+                        // Weight output channels:
+                        out_pixel.getSegmentPixel(out_segment) *= float(i) / float(ss_factor_sqr);
+                        // Update output metadata:
+                        out_segment.metadata.spmask = ss_weight_masks[i];
+                        out_segment.metadata.flags |= DEEP_PARTIAL_BIN_COVERAGE;
+                    }
+                }
+                else
+                {
+                    // Output only the dominant (just the average for now...) weight:
+                    // TODO: change this to some other weighting...?
                     DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
+                    // Weight output channels:
+                    out_pixel.getSegmentPixel(out_segment) *= (average_weight / float(transp_hits));
                     // Update output metadata:
-                    out_segment.metadata.spmask = out_opaque_mask;
-                    out_segment.metadata.flags &= ~DEEP_PARTIAL_BIN_COVERAGE;
+                    out_segment.metadata.spmask = out_transp_mask;
+                    out_segment.metadata.flags |= DEEP_PARTIAL_BIN_COVERAGE;
                 }
 
-                // Write partially-transparent segment if segment is included in accumulated transp mask:
-                // The transparent mask is the bins that are on but not opaque:
-                out_transp_mask = (out_mask & ~out_opaque_mask);
-#if 0//def DCX_DEBUG_TRANSFORM
-                if (debug) {
-                    std::cout << "   out_mask" << std::endl;
-                    out_mask.printPattern(std::cout, "   ");
-                    std::cout << "   out_opaque_mask" << std::endl;
-                    out_opaque_mask.printPattern(std::cout, "   ");
-                    std::cout << "   out_transp_mask" << std::endl;
-                    out_transp_mask.printPattern(std::cout, "   ");
+            }
+
+        } // segments loop
+
+    } // footprint loop
+
+}
+
+
+void
+DeepTransform::sampleTranslation (int outX,
+                                  int outY,
+                                  const DeepTile& deep_in_tile,
+                                  Dcx::DeepPixel& out_pixel)
+{
+    out_pixel.clear();
+
+    const float tx = m_imatrix[3][0];
+    const float ty = m_imatrix[3][1];
+
+    // Whole-pixel offsets just copy the input pixel:
+    if (tx == floorf(tx) && ty == floorf(ty))
+    {
+        deep_in_tile.getDeepPixel(outX + int(tx), outY + int(ty), out_pixel);
+        return;
+    }
+
+    const int ss_factor = std::min(std::max(m_ss_factor, 1), SSAMPLING_MAX);
+    const int ss_factor_sqr = ss_factor*ss_factor;
+
+    // The offset in subpixel bins is a whole number of bins B plus a
+    // fraction r. Of the ss_factor supersamples across each output bin,
+    // w[0] land B bins along and w[1] land B+1 bins along. Work out which
+    // input pixel (pix[]) and bin within it (bin[]) each of those starts at:
+    const float fbins[2] = { tx*float(SpMask8::width), ty*float(SpMask8::width) };
+    int pix[2][2], bin[2][2], w[2][2];
+    for (int axis=0; axis < 2; ++axis)
+    {
+        const float B = floorf(fbins[axis]);
+        const float r = fbins[axis] - B;
+        w[axis][0] = 0;
+        for (int k=0; k < ss_factor; ++k)
+            if ((float(k) + 0.5f)/float(ss_factor) + r < 1.0f)
+                ++w[axis][0];
+        w[axis][1] = ss_factor - w[axis][0];
+        for (int i=0; i < 2; ++i)
+        {
+            const int start = int(B) + i;
+            bin[axis][i] = ((start % SpMask8::width) + SpMask8::width) % SpMask8::width;
+            pix[axis][i] = (start - bin[axis][i]) / SpMask8::width;
+        }
+    }
+
+    Dcx::DeepPixel in_scratch(deep_in_tile.channels());
+    std::vector<SpMask8> ss_weight_masks(ss_factor_sqr);
+
+    // Output bins can take supersamples from up to four input bins, which
+    // can be spread across up to three input pixels in each direction:
+    for (int tY=outY + pix[1][0]; tY <= outY + pix[1][1] + 1; ++tY)
+    {
+        for (int tX=outX + pix[0][0]; tX <= outX + pix[0][1] + 1; ++tX)
+        {
+            if (tX < deep_in_tile.x() || tX > deep_in_tile.r() ||
+                tY < deep_in_tile.y() || tY > deep_in_tile.t())
+                continue;
+
+            // Find the shifts that move this input pixel's bins into the
+            // output pixel, and how many supersamples each shift gets:
+            int shiftX[4], shiftY[4], shiftW[4];
+            int nShifts = 0;
+            for (int j=0; j < 2; ++j)
+            {
+                const int b = tY - (outY + pix[1][j]);
+                if (w[1][j] == 0 || b < 0 || b > 1)
+                    continue;
+                for (int i=0; i < 2; ++i)
+                {
+                    const int a = tX - (outX + pix[0][i]);
+                    if (w[0][i] == 0 || a < 0 || a > 1)
+                        continue;
+                    shiftX[nShifts] = a*SpMask8::width - bin[0][i];
+                    shiftY[nShifts] = b*SpMask8::width - bin[1][j];
+                    shiftW[nShifts] = w[0][i]*w[1][j];
+                    ++nShifts;
                 }
-#endif
-                if (out_transp_mask != SpMask8::zeroCoverage)
+            }
+            if (nShifts == 0)
+                continue;
+
+            const Dcx::DeepPixel& in_pixel = *deep_in_tile.peekDeepPixel(tX, tY, in_scratch);
+            const size_t nSegments = in_pixel.size();
+            for (size_t segment=0; segment < nSegments; ++segment)
+            {
+                const DeepSegment& in_segment = in_pixel.getSegment(segment);
+                const SpMask8 in_mask = (!in_segment.zeroCoverage())?in_segment.spMask():SpMask8::fullCoverage;
+
+                SpMask8 shifted[4];
+                SpMask8 out_mask = SpMask8::zeroCoverage;
+                for (int n=0; n < nShifts; ++n)
                 {
-                    // Determine weights for each bin, then output the dominant weight, or
-                    // separate segments with the separate weights separated by subpixel bits:
-                    memset(&ss_weight_counts[0], 0, ss_factor_sqr);
-                    memset(&ss_weight_masks[0], 0, ss_factor_sqr*sizeof(SpMask8));
-
-                    float average_weight = 0.0f;
-                    int transp_hits = 0;
-                    SpMask8 count_mask(1ull);
-                    for (int sp_bin=0; sp_bin < SpMask8::numBits; ++sp_bin, count_mask <<= 1)
-                    {
-                        const int nHits = bin_hits[sp_bin];
-                        if (nHits == 0 || nHits >= ss_factor_sqr)
-                             continue;
-                        // Increment weight count for ss bin:
-                        ++ss_weight_counts[nHits];
-                        ss_weight_masks[nHits] |= (SpMask8(1ull) << sp_bin);
-                        //
-                        const float bin_weight = float(nHits) / float(ss_factor_sqr);
-                        average_weight += bin_weight;
-                        ++transp_hits;
-                    }
-                    //
-                    if (1)
+                    shifted[n] = in_mask.shifted(shiftX[n], shiftY[n]);
+                    out_mask |= shifted[n];
+                }
+                if (out_mask == SpMask8::zeroCoverage)
+                    continue;
+
+                // The hit count of an output bin is the sum of the weights
+                // of the shifted masks it's on in. Sort the bins by count,
+                // one combination of shifted masks at a time:
+                SpMask8 out_opaque_mask = SpMask8::zeroCoverage;
+                for (int i=1; i < ss_factor_sqr; ++i)
+                    ss_weight_masks[i] = SpMask8::zeroCoverage;
+                for (int combo=1; combo < (1 << nShifts); ++combo)
+                {
+                    SpMask8 combo_mask = SpMask8::fullCoverage;
+                    int nHits = 0;
+                    for (int n=0; n < nShifts; ++n)
                     {
-                        // Output separate segments for each weight bin, building a unique
-                        // subpixel mask for each:
-                        for (int i=1; i < ss_factor_sqr; ++i)
+                        if (combo & (1 << n))
                         {
-                            const int weight_count = ss_weight_counts[i];
-                            if (weight_count == 0)
-                                continue;
-                            DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
-                            // Weight output channels:
-                            out_pixel.getSegmentPixel(out_segment) *= float(i) / float(ss_factor_sqr);
-                            // Update output metadata:
-                            out_segment.metadata.spmask = ss_weight_masks[i];
-                            out_segment.metadata.flags |= DEEP_PARTIAL_BIN_COVERAGE;
+                            combo_mask &= shifted[n];
+                            nHits += shiftW[n];
                         }
+                        else
+                            combo_mask &= ~shifted[n];
                     }
+                    if (combo_mask == SpMask8::zeroCoverage)
+                        continue;
+                    if (nHits >= ss_factor_sqr)
+                        out_opaque_mask |= combo_mask;
                     else
-                    {
-                        // Output only the dominant (just the average for now...) weight:
-                        // TODO: change this to some other weighting...?
-                        DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
-                        // Weight output channels:
-                        out_pixel.getSegmentPixel(out_segment) *= (average_weight / float(transp_hits));
-                        // Update output metadata:
-                        out_segment.metadata.spmask = out_transp_mask;
-                        out_segment.metadata.flags |= DEEP_PARTIAL_BIN_COVERAGE;
-                    }
+                        ss_weight_masks[nHits] |= combo_mask;
+                }
 
+                // Write the opaque sample if the mask is non-zero:
+                if (out_opaque_mask != SpMask8::zeroCoverage)
+                {
+                    DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
+                    out_segment.metadata.spmask = out_opaque_mask;
+                    out_segment.metadata.flags &= ~DEEP_PARTIAL_BIN_COVERAGE;
                 }
 
-            } // segments loop
+                // Output separate segments for each partial weight:
+                for (int i=1; i < ss_factor_sqr; ++i)
+                {
+                    if (ss_weight_masks[i] == SpMask8::zeroCoverage)
+                        continue;
+                    DeepSegment& out_segment = out_pixel.getSegment(out_pixel.append(in_pixel, segment));
+                    out_pixel.getSegmentPixel(out_segment) *= float(i) / float(ss_factor_sqr);
+                    out_segment.metadata.spmask = ss_weight_masks[i];
+                    out_segment.metadata.flags |= DEEP_PARTIAL_BIN_COVERAGE;
+                }
+            }
+        }
+    }
+}
 
-        } // tX loop
 
-    } // tY loop
+/*static*/
+bool
+DeepTransform::reorientTile (const DeepTile& in_tile,
+                             DeepTile& out_tile,
+                             Orientation orientation)
+{
+    const bool swapXY = (orientation == ORIENT_ROTATE_90 ||
+                         orientation == ORIENT_ROTATE_270 ||
+                         orientation == ORIENT_TRANSPOSE);
+    const int inW = in_tile.w();
+    const int inH = in_tile.h();
+    if (!out_tile.writable() ||
+        out_tile.w() != ((swapXY)?inH:inW) ||
+        out_tile.h() != ((swapXY)?inW:inH))
+        return false;
+
+    DeepPixel deep_pixel(in_tile.channels());
+
+    // Step through the output in its own order, pulling from the input:
+    for (int outY=out_tile.y(); outY <= out_tile.t(); ++outY)
+    {
+        // Y-up row within the output data window:
+        const int v = (out_tile.tileYup())?(outY - out_tile.y()):(out_tile.t() - outY);
+        for (int outX=out_tile.x(); outX <= out_tile.r(); ++outX)
+        {
+            const int u = outX - out_tile.x();
+
+            // Y-up source column & row within the input data window:
+            int iu, iv;
+            switch (orientation)
+            {
+            default:
+            case ORIENT_NONE:       iu = u;         iv = v;         break;
+            case ORIENT_FLIP_X:     iu = inW-1 - u; iv = v;         break;
+            case ORIENT_FLIP_Y:     iu = u;         iv = inH-1 - v; break;
+            case ORIENT_ROTATE_90:  iu = v;         iv = inH-1 - u; break;
+            case ORIENT_ROTATE_180: iu = inW-1 - u; iv = inH-1 - v; break;
+            case ORIENT_ROTATE_270: iu = inW-1 - v; iv = u;         break;
+            case ORIENT_TRANSPOSE:  iu = v;         iv = u;         break;
+            }
+            const int inX = in_tile.x() + iu;
+            const int inY = (in_tile.tileYup())?(in_tile.y() + iv):(in_tile.t() - iv);
+
+            in_tile.getDeepPixel(inX, inY, deep_pixel);
 
+            // Reorient the subpixel masks to match:
+            const size_t nSegments = deep_pixel.size();
+            for (size_t i=0; i < nSegments && orientation != ORIENT_NONE; ++i)
+            {
+                const SpMask8 spmask = deep_pixel.getSegment(i).metadata.spmask;
+                if (spmask == SpMask8::zeroCoverage || spmask == SpMask8::fullCoverage)
+                    continue;
+                switch (orientation)
+                {
+                default:                break;
+                case ORIENT_FLIP_X:     deep_pixel.setSegmentMask(spmask.flippedX(), i, i); break;
+                case ORIENT_FLIP_Y:     deep_pixel.setSegmentMask(spmask.flippedY(), i, i); break;
+                case ORIENT_ROTATE_90:  deep_pixel.setSegmentMask(spmask.transposed().flippedX(), i, i); break;
+                case ORIENT_ROTATE_180: deep_pixel.setSegmentMask(spmask.flippedX().flippedY(), i, i); break;
+                case ORIENT_ROTATE_270: deep_pixel.setSegmentMask(spmask.transposed().flippedY(), i, i); break;
+                case ORIENT_TRANSPOSE:  deep_pixel.setSegmentMask(spmask.transposed(), i, i); break;
+                }
+            }
+
+            out_tile.setDeepPixel(outX, outY, deep_pixel);
+        }
+    }
+
+    return true;
+}
+
+
+//
+// Output rows shared by the transformTile() threads.  Rows are handed out
+// in small bands so a thread that lands on an expensive area doesn't hold
+// up the others.
+//
+
+struct TransformTileJob
+{
+    DeepTransform*      xform;
+    const DeepTile*     in_tile;
+    DeepTile*           out_tile;
+    int                 band_height;
+
+    pthread_mutex_t     mutex;
+    int                 next_row;
+
+    bool nextBand (int& y0, int& y1)
+    {
+        pthread_mutex_lock(&mutex);
+        y0 = next_row;
+        next_row += band_height;
+        pthread_mutex_unlock(&mutex);
+        y1 = std::min(y0 + band_height - 1, out_tile->t());
+        return (y0 <= out_tile->t());
+    }
+};
+
+
+static void*
+transformTileRows (void* data)
+{
+    TransformTileJob& job = *static_cast<TransformTileJob*>(data);
+    // Neighbouring output pixels read mostly the same input pixels:
+    const DeepTileCache in_tile(*job.in_tile);
+    DeepTile& out_tile = *job.out_tile;
+
+    DeepPixel out_pixel(out_tile.channels());
+    out_pixel.reserve(10);
+
+    int y0, y1;
+    while (job.nextBand(y0, y1))
+    {
+        for (int outY=y0; outY <= y1; ++outY)
+        {
+            for (int outX=out_tile.x(); outX <= out_tile.r(); ++outX)
+            {
+                job.xform->Dcx::DeepTransform::sample(outX, outY, in_tile, out_pixel);
+                out_tile.setDeepPixel(outX, outY, out_pixel);
+            }
+        }
+    }
+    return NULL;
 }
 
 
 /*virtual*/
 void
 DeepTransform::transformTile (const DeepTile& in_tile,
-                              DeepTile& out_tile)
+                              DeepTile& out_tile,
+                              int num_threads)
 {
     ChannelSet do_channels(out_tile.channels());
     do_channels &= in_tile.channels(); // Only process shared tile channels
 
-    DeepPixel out_pixel(out_tile.channels());
-    out_pixel.reserve(10);
+    const int nRows = out_tile.h();
+    if (nRows <= 0)
+        return;
 
-    for (int outY=out_tile.y(); outY <= out_tile.t(); ++outY)
+    if (num_threads <= 0)
+        num_threads = int(sysconf(_SC_NPROCESSORS_ONLN));
+    if (num_threads > nRows)
+        num_threads = nRows;
+    if (out_tile.writeAccessMode() != DeepTile::WRITE_RANDOM &&
+        out_tile.writeAccessMode() != DeepTile::WRITE_RANDOM_SCANLINE)
+        num_threads = 1;
+#ifdef DCX_DEBUG_TRANSFORM
+    num_threads = 1; // keep the debug output in order
+#endif
+
+    if (num_threads <= 1)
     {
-        for (int outX=out_tile.x(); outX <= out_tile.r(); ++outX)
+        // Neighbouring output pixels read mostly the same input pixels:
+        const DeepTileCache cached_in_tile(in_tile);
+        DeepPixel out_pixel(out_tile.channels());
+        out_pixel.reserve(10);
+
+        for (int outY=out_tile.y(); outY <= out_tile.t(); ++outY)
         {
-            Dcx::DeepTransform::sample(outX, outY, in_tile, out_pixel);
+            for (int outX=out_tile.x(); outX <= out_tile.r(); ++outX)
+            {
+                Dcx::DeepTransform::sample(outX, outY, cached_in_tile, out_pixel);
 #ifdef DCX_DEBUG_TRANSFORM
-            if (debug) {
-                std::cout << "out[" << outX << " " << outY << "]" << std::endl;
-                out_pixel.printInfo(std::cout, "out_pixel=", 4/*padding*/);
-            }
+                if (debug) {
+                    std::cout << "out[" << outX << " " << outY << "]" << std::endl;
+                    out_pixel.printInfo(std::cout, "out_pixel=", 4/*padding*/);
+                }
 #endif
-            out_tile.setDeepPixel(outX, outY, out_pixel);
+                out_tile.setDeepPixel(outX, outY, out_pixel);
+            }
         }
+        return;
     }
 
+    // Update the inverse matrix now so the threads only ever read it:
+    imatrix();
+
+    TransformTileJob job;
+    job.xform       = this;
+    job.in_tile     = &in_tile;
+    job.out_tile    = &out_tile;
+    job.band_height = std::max(1, nRows / (num_threads*4));
+    job.next_row    = out_tile.y();
+
+    pthread_mutex_init(&job.mutex, NULL);
+    // The calling thread does its share too:
+    std::vector<pthread_t> threads(num_threads - 1);
+    size_t nStarted = 0;
+    for (; nStarted < threads.size(); ++nStarted)
+        if (pthread_create(&threads[nStarted], NULL, transformTileRows, &job) != 0)
+            break; // carry on with the threads we've got
+    transformTileRows(&job);
+    for (size_t i=0; i < nStarted; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.mutex);
 }
 
 
@@ -90,7 +90,25 @@ class DCX_EXPORT DeepTransform
     enum FilterMode
     {
         FILTER_NEAREST,     //
-        FILTER_BOX          //
+        FILTER_BOX,         //
+        FILTER_GAUSSIAN,    // Gaussian, radius 1.5 output subpixel bins
+        FILTER_MITCHELL,    // Mitchell-Netravali (B=C=1/3), radius 2 bins
+        FILTER_LANCZOS      // Lanczos3, radius 3 bins
+    };
+
+    //
+    // Exact reorientations performed by reorientTile().
+    //
+
+    enum Orientation
+    {
+        ORIENT_NONE,        // Copy as-is
+        ORIENT_FLIP_X,      // Mirror left-right (flop)
+        ORIENT_FLIP_Y,      // Mirror top-bottom (flip)
+        ORIENT_ROTATE_90,   // Rotate 90 degrees counter-clockwise
+        ORIENT_ROTATE_180,  // Rotate 180 degrees
+        ORIENT_ROTATE_270,  // Rotate 90 degrees clockwise
+        ORIENT_TRANSPOSE    // Swap X and Y
     };
 
 
@@ -108,7 +126,21 @@ class DCX_EXPORT DeepTransform
     // Filter mode used during sample().
     //
 
-    bool filterMode() const;
+    FilterMode filterMode() const;
+
+
+    //
+    // Jitter each supersample within its cell of the regular grid by a
+    // fixed low-discrepancy (R2 sequence) offset. Edges alias as noise
+    // rather than stair-steps so a lower super_sampling factor can be
+    // used for rotations and non-integer scales. Every output pixel uses
+    // the same offsets so results are repeatable and affine footprints
+    // can still be shared. Pure translations don't supersample so aren't
+    // affected.
+    //
+
+    bool jitteredSampling () const;
+    void setJitteredSampling (bool enable);
 
 
     //
@@ -200,6 +232,8 @@ class DCX_EXPORT DeepTransform
 
     //
     // Sample input deep pixels with subpixel-mask resampling.
+    // Several threads may call this on one transform as long as none of
+    // them changes the matrix or sampling settings meanwhile.
     //
 
     virtual void sample (int outX,
@@ -208,19 +242,224 @@ class DCX_EXPORT DeepTransform
                          Dcx::DeepPixel& out_pixel);
 
 
+    //
+    // Resample every pixel of out_tile's data window from in_tile.
+    //
+    // If out_tile's write access mode allows rows to be written
+    // independently (WRITE_RANDOM or WRITE_RANDOM_SCANLINE) the data
+    // window is split into bands of rows shared between 'num_threads'
+    // threads, each with its own DeepPixel. 0 means one thread per core,
+    // the default of 1 samples on the calling thread.
+    // Each pixel is sampled the same way regardless of thread count so
+    // the result is identical to the single-threaded one.
+    // Only use threads if in_tile's getDeepPixel() and out_tile's
+    // setDeepPixel() are safe to call concurrently on different rows -
+    // ex. DeepImageOutputTile's getDeepPixel() is not, so don't thread
+    // a transform reading from one.
+    // WRITE_SEQUENTIAL tiles are always written on the calling thread.
+    //
+
     virtual void transformTile (const DeepTile& in_tile,
-                                DeepTile& out_tile);
+                                DeepTile& out_tile,
+                                int num_threads=1);
+
+
+    //
+    // Remap the pixels and subpixel masks of in_tile into out_tile without
+    // resampling. out_tile's data window must be the same size as in_tile's,
+    // with width and height swapped for the 90/270 rotations and transpose.
+    // Rotations are counter-clockwise viewed Y-up, regardless of the tiles'
+    // Y orientation. Output pixels are written in order so any write access
+    // mode is ok.
+    // Returns false if the data window sizes don't match or out_tile can't
+    // be written to.
+    //
+
+    static bool reorientTile (const DeepTile& in_tile,
+                              DeepTile& out_tile,
+                              Orientation orientation);
 
 
   protected:
 
+    //
+    // Where an output supersample lands in the input tile.
+    //
+
+    struct SupersampleHit
+    {
+        int     inX, inY;       // Input pixel
+        int     in_bit;         // Input subpixel bin
+        int     out_bin;        // Output subpixel bin, -1 if outside the output pixel
+        int     gridX, gridY;   // Location in the supersample grid
+
+        // Orders hits by input pixel (in tY, tX order), then output bin, then input bin:
+        bool    operator < (const SupersampleHit&) const;
+        bool    sameOutputBin (const SupersampleHit&) const;
+    };
+
+    //
+    // The input pixels and subpixel bins an output pixel's supersamples
+    // land in. Each FootprintBin adds popcount(in_mask & in_bits) hits to
+    // output bin 'out_bin'. An input bin hit more than once by the same
+    // output bin appears in that many FootprintBins.
+    //
+
+    struct FootprintBin
+    {
+        uint64_t    in_bits;    // Input subpixel bins
+        int         out_bin;    // Output subpixel bin they land in
+    };
+
+    //
+    // Filtered modes instead weight each input bin's contribution to the
+    // output bins by the filter kernel.
+    //
+
+    struct FootprintWeight
+    {
+        int         in_bit;     // Input subpixel bin
+        int         out_bin;    // Output subpixel bin
+        float       weight;     // Sum of the kernel weights of in_bit's supersamples
+    };
+
+    struct FootprintPixel
+    {
+        int                             dx, dy;     // Input pixel, relative to the footprint origin
+        std::vector<FootprintBin>       bins;       // FILTER_BOX
+        std::vector<FootprintWeight>    weights;    // Filtered modes
+    };
+
+    typedef std::vector<FootprintPixel> Footprint;
+
+
+    //
+    // Back-project a superW x superW grid of supersamples starting at
+    // output location x0,y0 and spaced 'step' apart, transforming each one
+    // through 'm'. The grid is padded by 'margin' supersamples all round
+    // for the filter kernel to reach into, giving (superW + 2*margin)^2 hits.
+    //
+
+    static void backProjectSupersamples (float x0,
+                                         float y0,
+                                         float step,
+                                         int superW,
+                                         int ss_factor,
+                                         int margin,
+                                         const IMATH_NAMESPACE::M44f& m,
+                                         const float* jitter,
+                                         SupersampleHit* hits);
+
+    //
+    // As above for an affine matrix, stepping through the grid with dP/dx
+    // & dP/dy adds from 'origin', the first supersample's input location.
+    //
+    // If 'jitter' is non-NULL it's a buildJitterTable() table for the grid
+    // and each supersample is offset from its cell center by it.
+    //
+
+    static void stepSupersamples (const IMATH_NAMESPACE::V2f& origin,
+                                  float step,
+                                  int superW,
+                                  int ss_factor,
+                                  int margin,
+                                  const IMATH_NAMESPACE::M44f& m,
+                                  const float* jitter,
+                                  SupersampleHit* hits);
+
+    //
+    // Build a Footprint from supersample hits, with input pixels relative
+    // to baseX,baseY and in tY, tX order.
+    // If 'filter_table' is non-NULL it's a buildFilterTable() table for the
+    // hits' grid and FootprintWeights are built rather than FootprintBins.
+    //
+
+    static void buildFootprint (const std::vector<SupersampleHit>& hits,
+                                int baseX,
+                                int baseY,
+                                const float* filter_table,
+                                int grid_width,
+                                Footprint& footprint);
+
+    //
+    // Build the 1D kernel table for a filtered mode: SpMask8::width rows
+    // of 'grid_width' weights, the row for output bin b holding the weight
+    // of each supersample column across the padded grid, normalized to sum
+    // to 1. Returns the grid margin in supersamples, or 0 (with the table
+    // left empty) for FILTER_NEAREST and FILTER_BOX.
+    //
+
+    static int  buildFilterTable (FilterMode filter_mode,
+                                  int ss_factor,
+                                  std::vector<float>& table);
+
+    //
+    // Build x,y offset pairs in -0.5..0.5 supersamples for each cell of a
+    // grid_width x grid_width supersample grid, in row order.
+    //
+
+    static void buildJitterTable (int grid_width,
+                                  std::vector<float>& table);
+
+    //
+    // For an affine matrix the footprint only depends on the fractional
+    // part of the back-projected supersample origin inX,inY. Returns the
+    // footprint for the nearest phase, building it the first time it's
+    // needed, and the input pixel its offsets are relative to.
+    // Safe to call from concurrent sample() calls, builds are serialized
+    // by m_footprint_mutex.
+    //
+
+    const Footprint& affineFootprint (float inX,
+                                      float inY,
+                                      int& baseX,
+                                      int& baseY);
+
+
+    //
+    // sample() for a pure translation. Integer offsets copy the input pixel
+    // as-is, fractional ones shift the input masks rather than supersampling.
+    //
+
+    void sampleTranslation (int outX,
+                            int outY,
+                            const DeepTile& deep_in_tile,
+                            Dcx::DeepPixel& out_pixel);
+
+
     IMATH_NAMESPACE::M44f   m_matrix;           // Scale/rot/trans matrix
     IMATH_NAMESPACE::M44f   m_imatrix;          // Inverse scale/rot/trans matrix
     bool                    m_updated;          // Is inverse matrix up to date?
+    bool                    m_affine;           // Is inverse matrix affine (no perspective)?
+    bool                    m_translate;        // Is inverse matrix only a 2D translation?
     float                   m_zTranslate;       // Separate from matrix for convenience
     float                   m_zScale;           // Separate from matrix for convenience
-    bool                    m_filter_mode;      // What kind of filtering to perform
+    FilterMode              m_filter_mode;      // What kind of filtering to perform
     int                     m_ss_factor;        // Sampling rate (can be different than subpixel mask res)
+    int                     m_filter_margin;    // Supersample grid padding for the filter kernel
+    std::vector<float>      m_filter_table;     // Kernel weights from buildFilterTable()
+    std::vector<float>      m_jitter_table;     // Supersample offsets from buildJitterTable(), empty if not jittered
+
+    int                     m_phases;           // Footprint phases per input pixel in x & y
+    std::vector<Footprint>  m_footprints;       // Affine footprint for each phase, built on demand
+    std::vector<char>       m_footprint_built;  // Which m_footprints have been built
+
+    //
+    // Mutex guarding the footprint builds. Copies of a DeepTransform get
+    // their own mutex rather than sharing or copying this one.
+    //
+
+    struct FootprintMutex
+    {
+        pthread_mutex_t m_mutex;
+
+        FootprintMutex () { pthread_mutex_init(&m_mutex, NULL); }
+        FootprintMutex (const FootprintMutex&) { pthread_mutex_init(&m_mutex, NULL); }
+        ~FootprintMutex () { pthread_mutex_destroy(&m_mutex); }
+        FootprintMutex& operator = (const FootprintMutex&) { return *this; }
+    };
+
+    FootprintMutex          m_footprint_mutex;
 
 };
 
@@ -231,14 +470,16 @@ class DCX_EXPORT DeepTransform
 //-----------------
 
 inline
-bool DeepTransform::filterMode () const { return m_filter_mode; }
+DeepTransform::FilterMode DeepTransform::filterMode () const { return m_filter_mode; }
+inline
+bool DeepTransform::jitteredSampling () const { return !m_jitter_table.empty(); }
 inline
 const IMATH_NAMESPACE::M44f& DeepTransform::matrix () const { return m_matrix; }
 inline
 void DeepTransform::setMatrix (const IMATH_NAMESPACE::M44f& m) { m_matrix = m; m_updated = false; }
 //
 inline
-void DeepTransform::makeIdentity () { m_matrix.makeIdentity(); m_imatrix.makeIdentity(); m_updated = true; }
+void DeepTransform::makeIdentity () { m_matrix.makeIdentity(); m_updated = false; }
 inline
 void DeepTransform::multiply (const IMATH_NAMESPACE::M44f& m) { m_matrix *= m; m_updated = false; }
 inline
@@ -62,17 +62,25 @@ OPENDCX_INTERNAL_NAMESPACE_HEADER_ENTER
 //
 //  class Pixel
 //
-//      Contains a fixed-size array of data and a ChannelSet
-//      defining the active channels.
+//      Contains an array of channel values and a ChannelSet defining
+//      the active channels.
 //
 //      Intentionally similar to Nuke's DD::Image::Pixel class.
 //
+//      Channel values are addressed directly by ChannelIdx, but the array is
+//      only sized to cover the channels actually used rather than the full
+//      Chan_Max range.  The predefined channels (ChannelIdx < numLocalChans)
+//      are stored inline so the common RGBA/Z/spmask case never touches the
+//      heap, and the array grows when a higher channel is enabled or written.
+//      Channels outside the array read back as zero.
+//
+//      Algorithms are free to write to channels that aren't enabled in the
+//      channel set (the flattener uses Chan_ZFront/Chan_CutoutA, etc as
+//      scratch,) so the array is not packed in channel-set order.
+//
 //      NOTE: This class is solely intended for use in image processing algorithms and
 //      *not* for multi-pixel data storage (ex. a line or tile's worth.)
 //
-//      (TODO: is it worth it to change this class to a packed-array?
-//       Managing the data packing/unpacking may be far more trouble than it's worth)
-//
 //-------------------------------------------------------------------------------------
 
 template <class T>
@@ -80,7 +88,6 @@ class DCX_EXPORT Pixel
 {
   public:
     ChannelSet  channels;                   // Set of enabled channels
-    T           chan[Dcx::Chan_Max+1];      // Fixed-sized array of channel values
 
 
   public:
@@ -113,6 +120,9 @@ class DCX_EXPORT Pixel
     Pixel (const Pixel&);
 
 
+    ~Pixel ();
+
+
     //-----------------------------
     // Set channels to zero (black)
     //-----------------------------
@@ -131,8 +141,26 @@ class DCX_EXPORT Pixel
     void    replace (const Pixel&);
 
 
+    //-------------------------------------------------------------
+    // Make sure the channel array covers all ChannelIdx's up to
+    // and including the highest one in the set / the ChannelIdx.
+    // New entries are zeroed.
+    //-------------------------------------------------------------
+
+    void    reserve (const ChannelSet&);
+    void    reserve (ChannelIdx);
+
+
+    //----------------------------------------------------------
+    // Number of ChannelIdx's currently covered by the array
+    //----------------------------------------------------------
+
+    size_t  arraySize () const;
+
+
     //-------------------------------------------
     // Pointer to beginning of channel data array
+    // (indexed by ChannelIdx, arraySize() long)
     //-------------------------------------------
 
     T* array();
@@ -196,8 +224,24 @@ class DCX_EXPORT Pixel
     Pixel  operator -  (T val) const;
     Pixel& operator -= (T val);
 
+
+  protected:
+
+    // Inline storage covers the predefined channels (see DcxChannelDefs.h)
+    enum { numLocalChans = 32 };
+
+    T*          m_chan;                     // Channel values, points at m_local or the heap
+    uint32_t    m_size;                     // Number of ChannelIdx's covered by m_chan
+    T           m_local[numLocalChans];     // Inline storage for the low ChannelIdx's
+
+    static const T  s_zero;                 // Returned for reads past the end of m_chan
+
+    void    grow (uint32_t size);
+
 };
 
+
+
 // Predefined types:
 typedef Pixel<int32_t>  Pixeli;
 typedef Pixel<uint32_t> Pixelu;  // Imf::UINT
@@ -215,65 +259,116 @@ typedef Pixel<double>   Pixeld;
 //-----------------
 
 template <class T>
-inline Pixel<T>::Pixel() {}
+/*static*/ const T Pixel<T>::s_zero = T(0);
+//---------------------------------------------------
+template <class T>
+inline Pixel<T>::Pixel() : m_chan(m_local), m_size(numLocalChans) {}
+template <class T>
+inline Pixel<T>::Pixel(const ChannelSet& set) :
+    channels(set),
+    m_chan(m_local),
+    m_size(numLocalChans)
+{
+    this->reserve(set);
+}
+template <class T>
+inline Pixel<T>::Pixel(const ChannelSet& set, T val) :
+    channels(set),
+    m_chan(m_local),
+    m_size(numLocalChans)
+{
+    this->reserve(set);
+    this->set(val);
+}
+template <class T>
+inline Pixel<T>::Pixel(const Pixel<T>& b) :
+    m_chan(m_local),
+    m_size(numLocalChans)
+{
+    *this = b;
+}
+template <class T>
+inline Pixel<T>::~Pixel() { if (m_chan != m_local) delete [] m_chan; }
+//---------------------------------------------------
+template <class T>
+inline void Pixel<T>::grow(uint32_t size)
+{
+    // Round up to limit reallocations when channels are added one at a time:
+    size = (size + numLocalChans-1) & ~uint32_t(numLocalChans-1);
+    T* chan = new T[size];
+    memcpy(chan, m_chan, sizeof(T)*m_size);
+    memset(chan + m_size, 0, sizeof(T)*(size - m_size));
+    if (m_chan != m_local)
+        delete [] m_chan;
+    m_chan = chan;
+    m_size = size;
+}
+template <class T>
+inline void Pixel<T>::reserve(ChannelIdx channel)
+{
+    if (channel >= m_size && channel <= Dcx::Chan_Max)
+        this->grow(channel+1);
+}
 template <class T>
-inline Pixel<T>::Pixel(const ChannelSet& set) : channels(set) {}
+inline void Pixel<T>::reserve(const ChannelSet& set) { this->reserve(set.last().channel()); }
 template <class T>
-inline Pixel<T>::Pixel(const ChannelSet& set, T val) : channels(set) { this->set(val); }
+inline size_t Pixel<T>::arraySize() const { return m_size; }
+//---------------------------------------------------
 template <class T>
-inline void Pixel<T>::erase() { memset(chan, 0, sizeof(T)*Dcx::Chan_Max); }
+inline void Pixel<T>::erase() { memset(m_chan, 0, sizeof(T)*m_size); }
 template <class T>
 inline void Pixel<T>::erase(const ChannelSet& set)
 {
+    this->reserve(set);
     foreach_channel(z, set)
-        chan[*z] = 0;
+        m_chan[*z] = 0;
 }
 template <class T>
-inline void Pixel<T>::erase(ChannelIdx channel) { chan[channel] = 0; }
+inline void Pixel<T>::erase(ChannelIdx channel) { (*this)[channel] = 0; }
 //---------------------------------------------------
 template <class T>
 inline void Pixel<T>::replace(const Pixel<T>& b, const ChannelSet& set)
 {
+    this->reserve(set);
     foreach_channel(z, set)
-        chan[*z] = b.chan[*z];
+        m_chan[*z] = b[*z];
 }
 
 template <class T>
-inline void Pixel<T>::replace(const Pixel<T>& b)
-{
-    foreach_channel(z, b.channels)
-        chan[*z] = b.chan[*z];
-}
+inline void Pixel<T>::replace(const Pixel<T>& b) { this->replace(b, b.channels); }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator = (const Pixel<T>& b) { channels = b.channels; this->replace(b); return *this; }
-template <class T>
-inline Pixel<T>::Pixel(const Pixel<T>& b) { *this = b; }
 //---------------------------------------------------
 template <class T>
-inline T& Pixel<T>::operator [] (ChannelIdx channel) { return chan[channel]; }
+inline T& Pixel<T>::operator [] (ChannelIdx channel)
+{
+    if (channel >= m_size)
+        this->grow(channel+1);
+    return m_chan[channel];
+}
 template <class T>
-inline const T& Pixel<T>::operator [] (ChannelIdx channel) const { return chan[channel]; }
+inline const T& Pixel<T>::operator [] (ChannelIdx channel) const { return (channel < m_size)?m_chan[channel]:s_zero; }
 template <class T>
-inline T& Pixel<T>::operator [] (ChannelSet::iterator z) { return chan[*z]; }
+inline T& Pixel<T>::operator [] (ChannelSet::iterator z) { return (*this)[*z]; }
 template <class T>
-inline const T& Pixel<T>::operator [] (ChannelSet::iterator z) const { return chan[*z]; }
+inline const T& Pixel<T>::operator [] (ChannelSet::iterator z) const { return (*this)[*z]; }
 template <class T>
-inline T* Pixel<T>::array() { return chan; }
+inline T* Pixel<T>::array() { return m_chan; }
 //---------------------------------------------------
 template <class T>
 inline Pixel<T>& Pixel<T>::operator = (T val)
 {
-    foreach_channel(z, channels)
-        chan[*z] = val;
+    this->set(val);
     return *this;
 }
 template <class T>
-inline void Pixel<T>::set(ChannelIdx channel, T val) { chan[channel] = val; }
+inline void Pixel<T>::set(ChannelIdx channel, T val) { (*this)[channel] = val; }
 template <class T>
 inline void Pixel<T>::set(T val)
 {
+    this->reserve(channels);
     foreach_channel(z, channels)
-        chan[*z] = val;
+        m_chan[*z] = val;
 }
 template <class T>
 inline void Pixel<T>::set(const ChannelSet& _set, T val)
@@ -287,29 +382,32 @@ inline Pixel<T> Pixel<T>::operator * (T val) const
 {
     Pixel<T> ret(channels);
     foreach_channel(z, channels)
-        ret.chan[*z] = chan[*z] * val;
+        ret.m_chan[*z] = (*this)[*z] * val;
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator *= (T val)
 {
+    this->reserve(channels);
     foreach_channel(z, channels)
-        chan[*z] *= val;
+        m_chan[*z] *= val;
     return *this;
 }
 template <class T>
 inline Pixel<T> Pixel<T>::operator * (const Pixel<T>& b) const
 {
     Pixel<T> ret(channels);
+    ret.reserve(b.channels);
     foreach_channel(z, b.channels)
-        ret.chan[*z] = (chan[*z] * b.chan[*z]);
+        ret.m_chan[*z] = ((*this)[*z] * b[*z]);
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator *= (const Pixel<T>& b)
 {
+    this->reserve(b.channels);
     foreach_channel(z, b.channels)
-        chan[*z] *= b.chan[*z];
+        m_chan[*z] *= b[*z];
     return *this;
 }
 //---------------------------------------------------
@@ -319,30 +417,33 @@ inline Pixel<T> Pixel<T>::operator / (T val) const
     const T ival = (T)1 / val;
     Pixel<T> ret(channels);
     foreach_channel(z, channels)
-        ret.chan[*z] = chan[*z]*ival;
+        ret.m_chan[*z] = (*this)[*z]*ival;
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator /= (T val)
 {
     const T ival = (T)1 / val;
+    this->reserve(channels);
     foreach_channel(z, channels)
-        chan[*z] *= ival;
+        m_chan[*z] *= ival;
     return *this;
 }
 template <class T>
 inline Pixel<T> Pixel<T>::operator / (const Pixel<T>& b) const
 {
     Pixel<T> ret(channels);
+    ret.reserve(b.channels);
     foreach_channel(z, b.channels)
-        ret.chan[*z] = (chan[*z] / b.chan[*z]);
+        ret.m_chan[*z] = ((*this)[*z] / b[*z]);
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator /= (const Pixel<T>& b)
 {
+    this->reserve(b.channels);
     foreach_channel(z, b.channels)
-        chan[*z] /= b.chan[*z];
+        m_chan[*z] /= b[*z];
     return *this;
 }
 //---------------------------------------------------
@@ -351,29 +452,32 @@ inline Pixel<T> Pixel<T>::operator + (T val) const
 {
     Pixel<T>ret(channels);
     foreach_channel(z, channels)
-        ret.chan[*z] = (chan[*z] + val);
+        ret.m_chan[*z] = ((*this)[*z] + val);
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator += (T val)
 {
+    this->reserve(channels);
     foreach_channel(z, channels)
-        chan[*z] += val;
+        m_chan[*z] += val;
     return *this;
 }
 template <class T>
 inline Pixel<T> Pixel<T>::operator + (const Pixel<T>& b) const
 {
     Pixel<T>ret(channels);
+    ret.reserve(b.channels);
     foreach_channel(z, b.channels)
-        ret.chan[*z] = (chan[*z] + b.chan[*z]);
+        ret.m_chan[*z] = ((*this)[*z] + b[*z]);
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator += (const Pixel<T>& b)
 {
+    this->reserve(b.channels);
     foreach_channel(z, b.channels)
-        chan[*z] += b.chan[*z];
+        m_chan[*z] += b[*z];
     return *this;
 }
 //---------------------------------------------------
@@ -382,29 +486,32 @@ inline Pixel<T> Pixel<T>::operator - (T val) const
 {
     Pixel<T> ret(channels);
     foreach_channel(z, channels)
-        ret.chan[*z] = (chan[*z] - val);
+        ret.m_chan[*z] = ((*this)[*z] - val);
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator -= (T val)
 {
+    this->reserve(channels);
     foreach_channel(z, channels)
-        chan[*z] -= val;
+        m_chan[*z] -= val;
     return *this;
 }
 template <class T>
 inline Pixel<T> Pixel<T>::operator - (const Pixel<T>& b) const
 {
     Pixel<T> ret(channels);
+    ret.reserve(b.channels);
     foreach_channel(z, b.channels)
-        ret.chan[*z] = (chan[*z] - b.chan[*z]);
+        ret.m_chan[*z] = ((*this)[*z] - b[*z]);
     return ret;
 }
 template <class T>
 inline Pixel<T>& Pixel<T>::operator -= (const Pixel<T>& b)
 {
+    this->reserve(b.channels);
     foreach_channel(z, b.channels)
-        chan[*z] -= b.chan[*z];
+        m_chan[*z] -= b[*z];
     return *this;
 }
 
@@ -233,6 +233,26 @@ class DCX_EXPORT SpMask8
                             int st);
 
 
+    //
+    // Return the pattern moved dx bins in +X and dy bins in +Y.  Bits
+    // moved past an edge are lost and vacated bins are turned off.
+    //
+
+    SpMask8 shifted (int dx,
+                     int dy) const;
+
+
+    //
+    // Exact reorientations of the pattern. transposed() swaps X and Y,
+    // flippedX() mirrors left-right and flippedY() mirrors top-bottom.
+    // Combine them for 90-degree rotations.
+    //
+
+    SpMask8 transposed () const;
+    SpMask8 flippedX () const;
+    SpMask8 flippedY () const;
+
+
     //
     // Map X/Y coord from a different mask size into SpMask8 range.
     // Output coords can be an overlap range.
@@ -379,6 +399,56 @@ inline int SpMask8::bitsOn () const
 #endif
 }
 inline int SpMask8::bitsOff() const { return (numBits - bitsOn()); }
+inline SpMask8 SpMask8::shifted (int dx, int dy) const
+{
+    if (dx <= -width || dx >= width || dy <= -height || dy >= height)
+        return SpMask8(allBitsOff);
+    uint64_t v = m;
+    // Shift whole rows in Y:
+    if (dy > 0)
+        v <<= (dy*width);
+    else if (dy < 0)
+        v >>= (-dy*width);
+    // Shift each row in X, clearing the bits that wrapped into the next row:
+    const uint64_t rowBits = 0x0101010101010101ull;
+    if (dx > 0)
+        v = (v << dx) & (rowBits*((0xffull << dx) & 0xffull));
+    else if (dx < 0)
+        v = (v >> -dx) & (rowBits*(0xffull >> -dx));
+    return SpMask8(v);
+}
+inline SpMask8 SpMask8::transposed () const
+{
+    // 8x8 bit-matrix transpose, swapping 1x1, then 2x2, then 4x4 blocks
+    // across the diagonal:
+    uint64_t v = m, t;
+    t = (v ^ (v >>  7)) & 0x00aa00aa00aa00aaull; v ^= t ^ (t <<  7);
+    t = (v ^ (v >> 14)) & 0x0000cccc0000ccccull; v ^= t ^ (t << 14);
+    t = (v ^ (v >> 28)) & 0x00000000f0f0f0f0ull; v ^= t ^ (t << 28);
+    return SpMask8(v);
+}
+inline SpMask8 SpMask8::flippedX () const
+{
+    // Reverse the bits in each row byte:
+    uint64_t v = m;
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0full) | ((v & 0x0f0f0f0f0f0f0f0full) << 4);
+    return SpMask8(v);
+}
+inline SpMask8 SpMask8::flippedY () const
+{
+    // Reverse the row bytes:
+#if defined(__GNUC__) || defined(__clang__)
+    return SpMask8(__builtin_bswap64(m));
+#else
+    uint64_t v = m;
+    v = ((v >>  8) & 0x00ff00ff00ff00ffull) | ((v & 0x00ff00ff00ff00ffull) <<  8);
+    v = ((v >> 16) & 0x0000ffff0000ffffull) | ((v & 0x0000ffff0000ffffull) << 16);
+    v = (v >> 32) | (v << 32);
+    return SpMask8(v);
+#endif
+}
 inline /*static*/ void SpMask8::mapXCoord (int inX, int inW, int& outX, int& outR)
 {
     if (inW == Dcx::SpMask8::width)
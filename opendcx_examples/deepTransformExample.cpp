@@ -77,8 +77,10 @@ usageMessage (const char argv0[], bool verbose=false)
                 "provide fractional-pixel filtering while preserving the subpixel mask functionality.\n"
                 "\n"
                 "Mask resampling options:\n"
-                "  -f <mode>  resample mask mode ('nearest', 'box') (default=box)\n"
+                "  -f <mode>  resample mask mode ('nearest', 'box', 'gaussian', 'mitchell',\n"
+                "             'lanczos') (default=box)\n"
                 "  -ss <int>  mask super-sampling factor (default=4)\n"
+                "  -jitter    jitter the mask super-samples\n"
                 "\n"
                 "Transform options:\n"
                 "  -t <x> <y> translate            (default=0.0,0.0)\n"
@@ -106,6 +108,7 @@ main (int argc, char *argv[])
     const char* outFile = 0;
 
     int   superSampling = 4;
+    bool  jitter        = false;
     Dcx::DeepTransform::FilterMode filterMode = Dcx::DeepTransform::FILTER_BOX;
     float translateX = 0.0f;
     float translateY = 0.0f;
@@ -148,6 +151,12 @@ main (int argc, char *argv[])
                 filterMode = Dcx::DeepTransform::FILTER_BOX;
             else if (!strcmp(argv[i + 1], "nearest"))
                 filterMode = Dcx::DeepTransform::FILTER_NEAREST;
+            else if (!strcmp(argv[i + 1], "gaussian"))
+                filterMode = Dcx::DeepTransform::FILTER_GAUSSIAN;
+            else if (!strcmp(argv[i + 1], "mitchell"))
+                filterMode = Dcx::DeepTransform::FILTER_MITCHELL;
+            else if (!strcmp(argv[i + 1], "lanczos"))
+                filterMode = Dcx::DeepTransform::FILTER_LANCZOS;
             i += 2;
         }
         else if (!strcmp(argv[i], "-t"))
@@ -203,6 +212,12 @@ main (int argc, char *argv[])
             infoInY = (int)floor(strtol(argv[i + 2], 0, 0));
             i += 3;
         }
+        else if (!strcmp(argv[i], "-jitter"))
+        {
+            // Jittered mask super-sampling:
+            jitter = true;
+            i += 1;
+        }
         else if (!strcmp(argv[i], "-v"))
         {
             // Verbose mode:
@@ -256,7 +271,7 @@ main (int argc, char *argv[])
         }
 
         // Output tile is copy of in tile:
-        Dcx::DeepImageOutputTile outDeepTile(inDeepTile);
+        Dcx::DeepImageOutputTile outDeepTile(inDeepTile, Dcx::DeepTile::WRITE_RANDOM_SCANLINE/*pixels written in order*/);
         outDeepTile.setOutputFile(outFile, Imf::INCREASING_Y/*lineOrder*/);
 
         if (centerX <= -INFINITYf)
@@ -266,6 +281,7 @@ main (int argc, char *argv[])
         }
 
         Dcx::DeepTransform xform(superSampling, filterMode);
+        xform.setJitteredSampling(jitter);
         xform.translate(centerX, centerY);
         xform.rotate(radians(rotateZ));
         xform.scale(scaleX, scaleY);
@@ -309,6 +325,9 @@ main (int argc, char *argv[])
             outDeepTile.writeScanline(outY, true/*flush*/);
         }
 
+        // Write the lines still buffered by writeScanline():
+        outDeepTile.flush();
+
         // If all lines are flushed on write the tile should be using zero bytes
         // by end:
         if (verbose)
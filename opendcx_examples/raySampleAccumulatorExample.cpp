@@ -421,7 +421,7 @@ main (int argc, char *argv[])
         // Output tile is copy of in tile.
         // This is for convenience, the output image can be completely
         // different.
-        Dcx::DeepImageOutputTile outDeepTile(inDeepTile);
+        Dcx::DeepImageOutputTile outDeepTile(inDeepTile, Dcx::DeepTile::WRITE_RANDOM_SCANLINE/*pixels written in order*/);
         outDeepTile.setOutputFile(outFile, Imf::INCREASING_Y/*lineOrder*/);
 
         // If camera translation not specified, move to output image w/2,h/2,w:
@@ -690,6 +690,9 @@ main (int argc, char *argv[])
 
         } // outY loop
 
+        // Write the lines still buffered by writeScanline():
+        outDeepTile.flush();
+
         // If all lines are flushed on write the tile should be using zero bytes
         // by end:
         if (verbose)
@@ -45,10 +45,10 @@
 
 
 #include <OpenEXR/ImfHeader.h>
-#include <OpenEXR/ImfDeepImageIO.h>
+#include <OpenEXR/ImfDeepScanLineInputFile.h>
 
 #include <OpenDCX/DcxChannelContext.h>
-#include <OpenDCX/DcxDeepImageTile.h>
+#include <OpenDCX/DcxDeepScanLineTile.h>
 
 #include <stdlib.h>
 
@@ -150,12 +150,11 @@ main (int argc, char *argv[])
 
     try
     {
-        Imf::Header inHeader; // for access to displayWindow...
-        Imf::DeepImage inDeepImage;
-        Imf::loadDeepScanLineImage(std::string(inFile), inHeader, inDeepImage);
+        Imf::DeepScanLineInputFile inDeepFile(inFile);
 
-        // Dcx::DeepTile stores the ChannelSet along with the channel ptrs:
-        Dcx::DeepImageInputTile inDeepTile(inHeader, inDeepImage, chanCtx, true/*Yup*/);
+        // Dcx::DeepTile stores the ChannelSet, and only decodes the scanlines
+        // that get read:
+        Dcx::DeepScanLineInputTile inDeepTile(inDeepFile, chanCtx, true/*Yup*/);
         if (verbose)
         {
             std::cout << "reading file '" << inFile << "'" << std::endl;
@@ -323,6 +323,7 @@ public:
         Dcx::Pixelf dcx_flattened(dcx_out_channels);
 
         Dcx::DeepPixel dcx_deep_pixel(dcx_flatten_channels);
+        Dcx::FlattenContext dcx_flatten_ctx; // reused scratch for the whole row
 
         // Don't use Row::erase(),we want to fill the row memory:
         foreach(z, out_channels)
@@ -357,7 +358,8 @@ public:
 
                 dcx_deep_pixel.flatten(dcx_flatten_channels,
                                        dcx_flattened,
-                                       (Dcx::InterpolationMode)k_interpolation_mode);
+                                       (Dcx::InterpolationMode)k_interpolation_mode,
+                                       &dcx_flatten_ctx);
 
                 // Copy flattened pixel to output row:
                 foreach(z, out_channels)
@@ -403,7 +405,8 @@ public:
                     for (int sp_x=0; sp_x < subpixels; ++sp_x) {
 
                         dcx_deep_pixel.flattenSubpixels(dcx_flatten_channels, dcx_flattened, sp_mask/*spmask*/,
-                                                        (Dcx::InterpolationMode)k_interpolation_mode/*interp_mode*/);
+                                                        (Dcx::InterpolationMode)k_interpolation_mode/*interp_mode*/,
+                                                        &dcx_flatten_ctx);
                         // Add flattended subpixel to accumulation pixel:
                         dcx_accum += dcx_flattened;
 